@@ -6,12 +6,271 @@
 #include <memory>
 #include <stdexcept>
 #include <sstream>
+#include <functional>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <string_view>
+#include <future>
+#include <chrono>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <spawn.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <sys/wait.h>
+#include <sys/file.h>
+#include <ctime>
 #include <curl/curl.h>
 #include <nlohmann/json.hpp>
 
+extern char** environ;
+
 using json = nlohmann::json;
 namespace fs = std::filesystem;
 
+// Fits a staged diff into a size budget before it goes into the prompt.
+// A diff within budget is left alone. Otherwise it is split per file and
+// hunk; lockfiles and generated files are dropped, and hunks are kept by
+// file importance (source, then tests, then docs and config), smaller
+// files first so that more files are shown. The --stat summary at the top
+// is always kept, so omitted parts are still named. Everything is viewed
+// in place until the result is assembled.
+class DiffSummarizer {
+public:
+    explicit DiffSummarizer(size_t max_bytes) : max_bytes(max_bytes) {}
+    
+    // Returns diff itself if it fits, otherwise a view of the summary, which
+    // is assembled in storage
+    std::string_view summarize(std::string_view diff, std::string& storage) const {
+        std::string_view stat;
+        std::vector<DiffFile> files = parse(diff, stat);
+        
+        size_t total = stat.size();
+        for (const auto& file : files) {
+            total += file.header.size();
+            for (auto hunk : file.hunks) {
+                total += hunk.size();
+            }
+        }
+        if (total <= max_bytes) {
+            return diff;
+        }
+        
+        // Choose hunks greedily by rank, then write them out in diff order
+        std::vector<size_t> order(files.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
+        }
+        std::stable_sort(order.begin(), order.end(), [&files](size_t a, size_t b) {
+            if (files[a].weight != files[b].weight) {
+                return files[a].weight > files[b].weight;
+            }
+            return files[a].size < files[b].size;
+        });
+        
+        // File headers come first, then the first hunk of every file (cut
+        // at a line if it is too big), then the rest, so that one big file
+        // can't crowd out all the others. kept is the bytes kept per hunk.
+        size_t used = std::min(stat.size(), max_bytes);
+        std::vector<std::vector<size_t>> kept(files.size());
+        std::vector<bool> header_kept(files.size(), false);
+        for (size_t index : order) {
+            const DiffFile& file = files[index];
+            kept[index].assign(file.hunks.size(), 0);
+            if (file.weight > 0 && used + file.header.size() <= max_bytes) {
+                used += file.header.size();
+                header_kept[index] = true;
+            }
+        }
+        for (bool first_hunks : {true, false}) {
+            for (size_t index : order) {
+                const DiffFile& file = files[index];
+                size_t count = first_hunks ? std::min<size_t>(file.hunks.size(), 1) : file.hunks.size();
+                for (size_t h = 0; header_kept[index] && h < count; ++h) {
+                    std::string_view hunk = file.hunks[h];
+                    if (kept[index][h] > 0) {
+                        continue;
+                    }
+                    if (used + hunk.size() <= max_bytes) {
+                        kept[index][h] = hunk.size();
+                    } else if (first_hunks && max_bytes - used >= min_partial_hunk) {
+                        size_t cut = hunk.rfind('\n', max_bytes - used - 1);
+                        kept[index][h] = cut == std::string_view::npos ? 0 : cut + 1;
+                    }
+                    used += kept[index][h];
+                }
+            }
+        }
+        
+        std::string& result = storage;
+        result.clear();
+        result.reserve(used + 4096);
+        if (stat.size() <= max_bytes) {
+            result += stat;
+        } else {
+            append_lines(result, stat, max_bytes);
+            result += "[fgit: diffstat truncated]\n";
+        }
+        for (size_t i = 0; i < files.size(); ++i) {
+            const DiffFile& file = files[i];
+            if (file.weight == 0) {
+                result += "[fgit: " + std::string(file.path) + " omitted (lockfile or generated)]\n";
+                continue;
+            }
+            if (!header_kept[i]) {
+                result += "[fgit: " + std::string(file.path) + " omitted to fit the size budget]\n";
+                continue;
+            }
+            result += file.header;
+            size_t omitted = 0;
+            size_t omitted_lines = 0;
+            for (size_t h = 0; h < file.hunks.size(); ++h) {
+                std::string_view hunk = file.hunks[h];
+                if (kept[i][h] == hunk.size()) {
+                    result += hunk;
+                } else if (kept[i][h] > 0) {
+                    result += hunk.substr(0, kept[i][h]);
+                    result += "[fgit: " + std::to_string(std::count(hunk.begin() + kept[i][h], hunk.end(), '\n')) +
+                              " more lines of this hunk omitted]\n";
+                } else {
+                    omitted++;
+                    omitted_lines += static_cast<size_t>(std::count(hunk.begin(), hunk.end(), '\n'));
+                }
+            }
+            if (omitted > 0) {
+                result += "[fgit: " + std::to_string(omitted) + " more hunk(s), " + std::to_string(omitted_lines) +
+                          " lines, of this file omitted to fit the size budget]\n";
+            }
+        }
+        return result;
+    }
+    
+private:
+    struct DiffFile {
+        std::string_view path;
+        std::string_view header;              // "diff --git" up to the first hunk
+        std::vector<std::string_view> hunks;
+        size_t size = 0;
+        int weight = 3;                       // 0 = dropped
+    };
+    
+    static constexpr size_t min_partial_hunk = 512; // smaller leftovers aren't worth a cut hunk
+    
+    size_t max_bytes;
+    
+    static bool starts_with(std::string_view text, std::string_view prefix) {
+        return text.substr(0, prefix.size()) == prefix;
+    }
+    
+    static bool ends_with(std::string_view text, std::string_view suffix) {
+        return text.size() >= suffix.size() && text.substr(text.size() - suffix.size()) == suffix;
+    }
+    
+    static int weight_of(std::string_view path) {
+        static const char* const lockfiles[] = {
+            "package-lock.json", "yarn.lock", "pnpm-lock.yaml", "Cargo.lock", "poetry.lock", "Pipfile.lock",
+            "Gemfile.lock", "composer.lock", "go.sum", "mix.lock", "Podfile.lock", "packages.lock.json"
+        };
+        static const char* const generated_suffixes[] = {
+            ".min.js", ".min.css", ".map", ".pb.go", ".pb.cc", ".pb.h", "_pb2.py", "_pb2_grpc.py", ".g.dart", ".lock"
+        };
+        static const char* const generated_dirs[] = {"node_modules/", "dist/", "generated/", "__generated__/"};
+        static const char* const doc_suffixes[] = {
+            ".md", ".txt", ".rst", ".json", ".yaml", ".yml", ".toml", ".ini", ".xml", ".cfg", ".csv"
+        };
+        
+        size_t slash = path.rfind('/');
+        std::string_view name = slash == std::string_view::npos ? path : path.substr(slash + 1);
+        for (const char* lockfile : lockfiles) {
+            if (name == lockfile) {
+                return 0;
+            }
+        }
+        for (const char* suffix : generated_suffixes) {
+            if (ends_with(name, suffix)) {
+                return 0;
+            }
+        }
+        for (const char* dir : generated_dirs) {
+            if (starts_with(path, dir) || path.find(std::string("/") + dir) != std::string_view::npos) {
+                return 0;
+            }
+        }
+        for (const char* suffix : doc_suffixes) {
+            if (ends_with(name, suffix)) {
+                return 1;
+            }
+        }
+        if (path.find("test") != std::string_view::npos || path.find("spec") != std::string_view::npos) {
+            return 2;
+        }
+        return 3;
+    }
+    
+    static std::vector<DiffFile> parse(std::string_view diff, std::string_view& stat) {
+        std::vector<DiffFile> files;
+        size_t pos = 0;
+        size_t first_file = diff.size();
+        DiffFile* file = nullptr;
+        size_t section_start = 0; // of the current header or hunk
+        bool in_header = false;
+        
+        auto close_section = [&](size_t end) {
+            if (!file) {
+                return;
+            }
+            std::string_view section = diff.substr(section_start, end - section_start);
+            if (in_header) {
+                file->header = section;
+            } else {
+                file->hunks.push_back(section);
+            }
+            file->size += section.size();
+        };
+        
+        while (pos < diff.size()) {
+            size_t end = diff.find('\n', pos);
+            end = end == std::string_view::npos ? diff.size() : end + 1;
+            std::string_view line = diff.substr(pos, end - pos);
+            
+            if (starts_with(line, "diff --git ")) {
+                close_section(pos);
+                if (files.empty()) {
+                    first_file = pos;
+                }
+                files.emplace_back();
+                file = &files.back();
+                size_t b = line.rfind(" b/");
+                file->path = b == std::string_view::npos ? line.substr(11) : line.substr(b + 3);
+                while (!file->path.empty() && (file->path.back() == '\n' || file->path.back() == '\r')) {
+                    file->path.remove_suffix(1);
+                }
+                file->weight = weight_of(file->path);
+                section_start = pos;
+                in_header = true;
+            } else if (file && starts_with(line, "@@")) {
+                close_section(pos);
+                section_start = pos;
+                in_header = false;
+            }
+            pos = end;
+        }
+        close_section(diff.size());
+        stat = diff.substr(0, first_file);
+        return files;
+    }
+    
+    // Whole lines of text, up to max bytes
+    static void append_lines(std::string& out, std::string_view text, size_t max) {
+        size_t cut = text.rfind('\n', max);
+        out += text.substr(0, cut == std::string_view::npos ? 0 : cut + 1);
+    }
+};
+
 class FGit {
 private:
     std::string gemini_api_key;
@@ -21,29 +280,277 @@ private:
                              "The message should follow standard conventions (e.g., imperative mood, short subject line, optional body). "
                              "In the body, use a bulleted list (dashes). Do not include the diff itself in the message, only the generated commit message text.";
     
+    // Kept for the whole session so that every redo reuses the connection
+    // (and its TLS session) instead of resolving and handshaking again
+    std::unique_ptr<CURL, decltype(&curl_easy_cleanup)> curl{nullptr, curl_easy_cleanup};
+    std::unique_ptr<curl_slist, decltype(&curl_slist_free_all)> headers{nullptr, curl_slist_free_all};
+    // Connects the handle while git is still producing the diff. Declared
+    // after the handle so that it is waited for before the handle goes;
+    // setting the flag makes a pending warm-up give up at once.
+    std::atomic<bool> warm_up_cancelled{false};
+    static constexpr std::chrono::milliseconds warm_up_limit{5000}; // whole HEAD request
+    static constexpr std::chrono::milliseconds warm_up_wait{1000};  // how long a request waits for it
+    std::future<void> warm_up;
+    std::string staged_key; // hash of the staged changes, empty if unknown or nothing is staged
+    std::string gemini_model = "gemini-1.5-flash-latest";
+    std::string gemini_url;
+    bool stream_responses = true; // GEMINI_STREAM=0 in ~/.fgit.conf waits for the whole response
+    int candidate_count = 1;      // GEMINI_CANDIDATES=N: extra candidates make redos instant
+    size_t max_diff_tokens = 30000; // GEMINI_MAX_DIFF_TOKENS=N: larger diffs are summarized, 0 = no limit
+    bool background_push = false;   // BACKGROUND_PUSH=1: return after the commit, push from a worker
+    
     static size_t WriteCallback(void* contents, size_t size, size_t nmemb, std::string* userp) {
         userp->append((char*)contents, size * nmemb);
         return size * nmemb;
     }
     
-    std::string execute_command(const std::string& command) {
-        std::array<char, 128> buffer;
-        std::string result;
-        std::unique_ptr<FILE, decltype(&pclose)> pipe(popen(command.c_str(), "r"), pclose);
+    // Incremental reader for streamGenerateContent?alt=sse. Every event is
+    // one or more "data:" lines holding a response chunk as JSON; its text
+    // is passed on as soon as the event is complete. A body that isn't an
+    // event stream (such as an error) is kept whole for the caller.
+    class SseStream {
+    public:
+        explicit SseStream(std::function<void(const std::string&)> on_text) : on_text(std::move(on_text)) {}
+        
+        void feed(const char* data, size_t size) {
+            raw.append(data, size);
+            pending.append(data, size);
+            size_t end;
+            while ((end = pending.find('\n')) != std::string::npos) {
+                std::string line = pending.substr(0, end);
+                pending.erase(0, end + 1);
+                if (!line.empty() && line.back() == '\r') {
+                    line.pop_back();
+                }
+                take_line(line);
+            }
+        }
+        
+        // The last event may not be followed by a blank line
+        void finish() {
+            if (!pending.empty()) {
+                take_line(pending);
+                pending.clear();
+            }
+            take_line("");
+        }
+        
+        bool had_events() const { return events > 0; }
+        const std::vector<std::string>& candidates() const { return messages; }
+        const std::string& body() const { return raw; }
+        
+        static size_t Callback(void* contents, size_t size, size_t nmemb, SseStream* stream) {
+            try {
+                stream->feed(static_cast<const char*>(contents), size * nmemb);
+            } catch (const json::parse_error& e) {
+                stream->failure = "Failed to parse streamed response: " + std::string(e.what());
+                return 0; // aborts the transfer
+            } catch (const std::exception& e) {
+                stream->failure = e.what();
+                return 0;
+            }
+            return size * nmemb;
+        }
+        
+        const std::string& error() const { return failure; }
+        
+    private:
+        std::function<void(const std::string&)> on_text;
+        std::string raw;
+        std::string pending; // an incomplete line
+        std::string data;    // data lines of the current event
+        std::vector<std::string> messages; // text so far of each candidate
+        std::string failure;
+        int events = 0;
+        
+        void take_line(const std::string& line) {
+            if (line.empty()) {
+                if (!data.empty()) {
+                    events++;
+                    std::vector<std::string> chunks = candidate_texts(json::parse(data));
+                    data.clear();
+                    if (messages.size() < chunks.size()) {
+                        messages.resize(chunks.size());
+                    }
+                    for (size_t i = 0; i < chunks.size(); ++i) {
+                        messages[i] += chunks[i];
+                    }
+                    // Only the first candidate is shown while it arrives
+                    if (!chunks.empty() && !chunks[0].empty()) {
+                        on_text(chunks[0]);
+                    }
+                }
+                return;
+            }
+            if (line.compare(0, 5, "data:") == 0) {
+                size_t start = line.size() > 5 && line[5] == ' ' ? 6 : 5;
+                if (!data.empty()) {
+                    data += '\n';
+                }
+                data.append(line, start, std::string::npos);
+            }
+        }
+    };
+    
+    // Text of each candidate in a generateContent response, or in one
+    // streamed chunk (where a candidate may carry no text, e.g. only its
+    // finish reason)
+    static std::vector<std::string> candidate_texts(const json& response) {
+        // Check for API errors
+        if (response.contains("error")) {
+            std::stringstream error_msg;
+            error_msg << "Gemini API returned an error: " << response["error"];
+            throw std::runtime_error(error_msg.str());
+        }
         
-        if (!pipe) {
-            throw std::runtime_error("popen() failed!");
+        std::vector<std::string> texts;
+        if (!response.contains("candidates")) {
+            return texts;
+        }
+        const json& candidates = response["candidates"];
+        for (size_t i = 0; i < candidates.size(); ++i) {
+            const json& candidate = candidates[i];
+            size_t index = candidate.value("index", i);
+            if (texts.size() <= index) {
+                texts.resize(index + 1);
+            }
+            if (candidate.contains("content") && candidate["content"].contains("parts")) {
+                for (const auto& part : candidate["content"]["parts"]) {
+                    if (part.contains("text")) {
+                        texts[index] += part["text"].get<std::string>();
+                    }
+                }
+            }
+        }
+        return texts;
+    }
+    
+    // Candidates worth showing, in order; throws if there are none
+    static std::vector<std::string> usable_candidates(const std::vector<std::string>& texts) {
+        std::vector<std::string> usable;
+        for (const auto& text : texts) {
+            if (!text.empty()) {
+                usable.push_back(text);
+            }
+        }
+        if (usable.empty()) {
+            throw std::runtime_error("Could not extract commit message from Gemini response");
+        }
+        return usable;
+    }
+    
+    // Runs a program found on PATH directly, without a shell. If given,
+    // input is written to its stdin and its stdout is collected into output;
+    // otherwise both stay on the terminal. Returns the exit status.
+    static int run_process(const std::vector<std::string>& args, const std::string* input,
+                           std::string* output, bool quiet_errors = false) {
+        std::vector<char*> argv;
+        for (const auto& arg : args) {
+            argv.push_back(const_cast<char*>(arg.c_str()));
         }
+        argv.push_back(nullptr);
         
-        while (fgets(buffer.data(), buffer.size(), pipe.get()) != nullptr) {
-            result += buffer.data();
+        int in_pipe[2] = {-1, -1};
+        int out_pipe[2] = {-1, -1};
+        if ((input && pipe2(in_pipe, O_CLOEXEC) != 0) || (output && pipe2(out_pipe, O_CLOEXEC) != 0)) {
+            throw std::runtime_error("pipe() failed for " + args[0]);
         }
         
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        if (input) {
+            posix_spawn_file_actions_adddup2(&actions, in_pipe[0], STDIN_FILENO);
+        }
+        if (output) {
+            posix_spawn_file_actions_adddup2(&actions, out_pipe[1], STDOUT_FILENO);
+        }
+        if (quiet_errors) {
+            posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+        }
+        
+        pid_t pid;
+        int spawn_error = posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+        posix_spawn_file_actions_destroy(&actions);
+        for (int fd : {in_pipe[0], out_pipe[1]}) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+        if (spawn_error != 0) {
+            for (int fd : {in_pipe[1], out_pipe[0]}) {
+                if (fd >= 0) {
+                    close(fd);
+                }
+            }
+            throw std::runtime_error("Could not run " + args[0] + ": " + std::strerror(spawn_error));
+        }
+        
+        // Input is written in full before output is read; callers pass only
+        // one of the two, so this cannot deadlock.
+        if (input) {
+            for (size_t written = 0; written < input->size();) {
+                ssize_t n = write(in_pipe[1], input->data() + written, input->size() - written);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    break;
+                }
+                written += n;
+            }
+            close(in_pipe[1]);
+        }
+        if (output) {
+            char buffer[1 << 16];
+            for (;;) {
+                ssize_t n = read(out_pipe[0], buffer, sizeof(buffer));
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    break;
+                }
+                output->append(buffer, n);
+            }
+            close(out_pipe[0]);
+        }
+        
+        int status;
+        while (waitpid(pid, &status, 0) < 0) {
+            if (errno != EINTR) {
+                return -1;
+            }
+        }
+        return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    }
+    
+    std::string execute_command(const std::vector<std::string>& args, bool quiet_errors = false) {
+        std::string result;
+        if (run_process(args, nullptr, &result, quiet_errors) != 0) {
+            throw std::runtime_error(args[0] + " " + args[1] + " failed");
+        }
         return result;
     }
     
-    int execute_command_with_status(const std::string& command) {
-        return system(command.c_str());
+    // First line of a command's output, for git plumbing that prints one value
+    std::string output_line(const std::vector<std::string>& args) {
+        std::string line = execute_command(args, true);
+        line.erase(std::min(line.find('\n'), line.size()));
+        return line;
+    }
+    
+    static bool on_path(const std::string& program) {
+        const char* path = std::getenv("PATH");
+        std::string_view dirs = path ? path : "";
+        while (!dirs.empty()) {
+            size_t end = std::min(dirs.find(':'), dirs.size());
+            std::string dir(dirs.substr(0, end));
+            if (access(((dir.empty() ? "." : dir) + "/" + program).c_str(), X_OK) == 0) {
+                return true;
+            }
+            dirs.remove_prefix(std::min(end + 1, dirs.size()));
+        }
+        return false;
     }
     
     void load_config() {
@@ -64,6 +571,28 @@ private:
             // Skip empty lines and comments
             if (line.empty() || line[0] == '#') continue;
             
+            if (line.rfind("GEMINI_CANDIDATES=", 0) == 0) {
+                candidate_count = std::max(1, std::min(8, std::atoi(line.c_str() + 18)));
+                continue;
+            }
+            if (line.rfind("GEMINI_MAX_DIFF_TOKENS=", 0) == 0) {
+                // A value that isn't a number keeps the default
+                char* end;
+                unsigned long tokens = std::strtoul(line.c_str() + 23, &end, 10);
+                if (end != line.c_str() + 23 && *end == '\0') {
+                    max_diff_tokens = tokens;
+                }
+                continue;
+            }
+            if (line.rfind("BACKGROUND_PUSH=", 0) == 0) {
+                background_push = line.substr(16) == "1" || line.substr(16) == "true";
+                continue;
+            }
+            if (line.rfind("GEMINI_STREAM=", 0) == 0) {
+                stream_responses = line.substr(14) != "0" && line.substr(14) != "false";
+                continue;
+            }
+            
             // Look for GEMINI_API_KEY=value
             size_t pos = line.find("GEMINI_API_KEY=");
             if (pos != std::string::npos) {
@@ -72,7 +601,6 @@ private:
                 if (gemini_api_key.front() == '"' && gemini_api_key.back() == '"') {
                     gemini_api_key = gemini_api_key.substr(1, gemini_api_key.length() - 2);
                 }
-                break;
             }
         }
         
@@ -83,12 +611,12 @@ private:
     
     void check_dependencies() {
         // Check for git
-        if (system("which git > /dev/null 2>&1") != 0) {
+        if (!on_path("git")) {
             throw std::runtime_error("git is not installed or not in PATH");
         }
         
         // Check for curl (though we're using libcurl)
-        if (system("which curl > /dev/null 2>&1") != 0) {
+        if (!on_path("curl")) {
             throw std::runtime_error("curl is not installed or not in PATH");
         }
     }
@@ -97,11 +625,11 @@ private:
         std::cout << "Fetching git diff (staged files)..." << std::endl;
         
         try {
-            std::string diff_output = execute_command("git diff --staged --unified=8 --function-context --no-color --stat");
+            std::string diff_output = execute_command({"git", "diff", "--staged", "--unified=8", "--function-context",
+                                                        "--no-color", "--patch-with-stat"});
             
             if (diff_output.empty()) {
                 std::cout << "No staged changes detected. Nothing to commit." << std::endl;
-                exit(0);
             }
             
             return diff_output;
@@ -110,79 +638,219 @@ private:
         }
     }
     
-    std::string call_gemini(const std::string& diff_content) {
-        CURL* curl;
-        CURLcode res;
-        std::string response_data;
+    // The persistent handle, set up on first use. Options that don't change
+    // between requests are set only here.
+    CURL* http_handle() {
+        if (curl) {
+            return curl.get();
+        }
         
-        curl = curl_easy_init();
+        curl.reset(curl_easy_init());
         if (!curl) {
             throw std::runtime_error("Failed to initialize curl");
         }
         
-        // Prepare the prompt
-        std::string prompt_text = base_prompt + "\n\n```diff\n" + diff_content + "\n```";
+        gemini_url = "https://generativelanguage.googleapis.com/v1beta/models/" + gemini_model;
+        headers.reset(curl_slist_append(nullptr, "Content-Type: application/json"));
         
-        // Create JSON payload
-        json payload = {
-            {"contents", {{
-                {"parts", {{
-                    {"text", prompt_text}
-                }}}
-            }}}
-        };
+        CURL* handle = curl.get();
+        curl_easy_setopt(handle, CURLOPT_HTTPHEADER, headers.get());
         
-        std::string json_string = payload.dump();
-        std::string url = "https://generativelanguage.googleapis.com/v1beta/models/gemini-1.5-flash-latest:generateContent?key=" + gemini_api_key;
+        // HTTP/2 when the server offers it over TLS, and TCP keep-alive so
+        // the connection survives while the user reads a suggestion
+        curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+        curl_easy_setopt(handle, CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt(handle, CURLOPT_TCP_KEEPIDLE, 30L);
+        curl_easy_setopt(handle, CURLOPT_TCP_KEEPINTVL, 15L);
+        return handle;
+    }
+    
+    // Resolve, connect and handshake with the API host in the background: a
+    // HEAD request for the root leaves the connection in the handle's cache,
+    // where the first real request picks it up. Its outcome doesn't matter;
+    // if it fails, that request just connects by itself.
+    void start_warm_up() {
+        CURL* handle = http_handle();
+        std::string host_root = gemini_url.substr(0, gemini_url.find('/', gemini_url.find("//") + 2) + 1);
+        std::atomic<bool>* cancelled = &warm_up_cancelled;
+        warm_up = std::async(std::launch::async, [handle, host_root, cancelled] {
+            curl_easy_setopt(handle, CURLOPT_URL, host_root.c_str());
+            curl_easy_setopt(handle, CURLOPT_NOBODY, 1L);
+            curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, DiscardCallback);
+            curl_easy_setopt(handle, CURLOPT_TIMEOUT_MS, static_cast<long>(warm_up_limit.count()));
+            curl_easy_setopt(handle, CURLOPT_XFERINFOFUNCTION, WarmUpProgress);
+            curl_easy_setopt(handle, CURLOPT_XFERINFODATA, cancelled);
+            curl_easy_setopt(handle, CURLOPT_NOPROGRESS, 0L);
+            curl_easy_perform(handle);
+            curl_easy_setopt(handle, CURLOPT_NOPROGRESS, 1L);
+            curl_easy_setopt(handle, CURLOPT_NOBODY, 0L);
+            curl_easy_setopt(handle, CURLOPT_TIMEOUT_MS, 0L);
+        });
+    }
+    
+    static size_t DiscardCallback(void*, size_t size, size_t nmemb, void*) {
+        return size * nmemb;
+    }
+    
+    // Nonzero aborts the transfer; curl calls this during resolve and connect too
+    static int WarmUpProgress(void* cancelled, curl_off_t, curl_off_t, curl_off_t, curl_off_t) {
+        return static_cast<std::atomic<bool>*>(cancelled)->load() ? 1 : 0;
+    }
+    
+    // The handle may only be used again once the warm-up is done with it
+    void finish_warm_up() {
+        if (warm_up.valid()) {
+            warm_up.get();
+        }
+    }
+    
+    // Before the first real request: a warm-up that is nearly done is worth
+    // waiting for, but one that has stalled is abandoned after about a
+    // normal connect, and the request connects by itself
+    void await_warm_up() {
+        if (warm_up.valid() && warm_up.wait_for(warm_up_wait) != std::future_status::ready) {
+            cancel_warm_up();
+        }
+        finish_warm_up();
+    }
+    
+    // For leaving early: abort the warm-up rather than wait for its timeout
+    void cancel_warm_up() {
+        warm_up_cancelled = true;
+        finish_warm_up();
+        warm_up_cancelled = false;
+    }
+    
+    // Append text as the contents of a JSON string. Invalid UTF-8 (diffs of
+    // files in other encodings) becomes U+FFFD instead of failing the dump.
+    static void append_json_string(std::string& out, std::string_view text) {
+        static const char hex[] = "0123456789abcdef";
+        size_t i = 0;
+        while (i < text.size()) {
+            unsigned char c = static_cast<unsigned char>(text[i]);
+            if (c >= 0x80) {
+                size_t length = c >= 0xf5 ? 0 : c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc2 ? 2 : 0;
+                bool valid = length > 0 && i + length <= text.size();
+                for (size_t k = 1; valid && k < length; ++k) {
+                    valid = (static_cast<unsigned char>(text[i + k]) & 0xc0) == 0x80;
+                }
+                if (valid && length > 2) {
+                    // No overlong forms, surrogates or code points past U+10FFFF
+                    unsigned char next = static_cast<unsigned char>(text[i + 1]);
+                    valid = !(c == 0xe0 && next < 0xa0) && !(c == 0xed && next >= 0xa0) &&
+                            !(c == 0xf0 && next < 0x90) && !(c == 0xf4 && next >= 0x90);
+                }
+                if (valid) {
+                    out.append(text.data() + i, length);
+                    i += length;
+                } else {
+                    out += "\xef\xbf\xbd";
+                    i++;
+                }
+                continue;
+            }
+            switch (c) {
+                case '"': out += "\\\""; break;
+                case '\\': out += "\\\\"; break;
+                case '\n': out += "\\n"; break;
+                case '\r': out += "\\r"; break;
+                case '\t': out += "\\t"; break;
+                default:
+                    if (c < 0x20) {
+                        out += "\\u00";
+                        out += hex[c >> 4];
+                        out += hex[c & 0xf];
+                    } else {
+                        out += static_cast<char>(c);
+                    }
+            }
+            i++;
+        }
+    }
+    
+    // The request body, built once per diff and reused by every redo. The
+    // prompt is escaped straight into it rather than assembled, copied into
+    // a json tree and dumped.
+    std::string build_payload(const std::string& diff_output) const {
+        std::string summary;
+        std::string_view diff = diff_output;
+        if (max_diff_tokens > 0) {
+            diff = DiffSummarizer(max_diff_tokens * 4).summarize(diff_output, summary); // ~4 bytes per token
+        }
+        if (diff.data() != diff_output.data()) {
+            std::cout << "Diff summarized from " << diff_output.size() << " to " << diff.size()
+                      << " bytes to fit GEMINI_MAX_DIFF_TOKENS." << std::endl;
+        }
         
-        // Set curl options
-        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json_string.c_str());
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response_data);
+        std::string payload;
+        payload.reserve(diff.size() + diff.size() / 8 + base_prompt.size() + 256);
+        payload += "{\"contents\":[{\"parts\":[{\"text\":\"";
+        append_json_string(payload, base_prompt);
+        append_json_string(payload, "\n\n```diff\n");
+        append_json_string(payload, diff);
+        append_json_string(payload, "\n```");
+        payload += "\"}]}]";
+        if (candidate_count > 1) {
+            payload += ",\"generationConfig\":{\"candidateCount\":" + std::to_string(candidate_count) + "}";
+        }
+        payload += "}";
+        return payload;
+    }
+    
+    // Ask for commit messages, candidate_count of them in one request. on_text
+    // gets the first candidate's text as it arrives: piece by piece when
+    // streaming, otherwise all at once. Returns every candidate with text.
+    std::vector<std::string> call_gemini(const std::string& payload, const std::function<void(const std::string&)>& on_text) {
+        await_warm_up();
+        CURL* handle = http_handle();
+        CURLcode res;
+        std::string response_data;
+        SseStream stream(on_text);
+        
+        std::string url = gemini_url + (stream_responses ? ":streamGenerateContent?alt=sse&key=" : ":generateContent?key=") + gemini_api_key;
         
-        // Set headers
-        struct curl_slist* headers = nullptr;
-        headers = curl_slist_append(headers, "Content-Type: application/json");
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+        // Set the per-request options
+        curl_easy_setopt(handle, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(handle, CURLOPT_POSTFIELDS, payload.c_str());
+        curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)payload.size());
+        if (stream_responses) {
+            curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, SseStream::Callback);
+            curl_easy_setopt(handle, CURLOPT_WRITEDATA, &stream);
+        } else {
+            curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, WriteCallback);
+            curl_easy_setopt(handle, CURLOPT_WRITEDATA, &response_data);
+        }
         
         std::cout << "Calling Gemini API..." << std::endl;
         
         // Perform the request
-        res = curl_easy_perform(curl);
-        
-        // Clean up
-        curl_slist_free_all(headers);
-        curl_easy_cleanup(curl);
+        res = curl_easy_perform(handle);
         
+        if (!stream.error().empty()) {
+            throw std::runtime_error(stream.error());
+        }
         if (res != CURLE_OK) {
             throw std::runtime_error("curl_easy_perform() failed: " + std::string(curl_easy_strerror(res)));
         }
         
-        // Parse JSON response
-        try {
-            json response = json::parse(response_data);
-            
-            // Check for API errors
-            if (response.contains("error")) {
-                std::stringstream error_msg;
-                error_msg << "Gemini API returned an error: " << response["error"];
-                throw std::runtime_error(error_msg.str());
+        if (stream_responses) {
+            try {
+                stream.finish();
+            } catch (const json::parse_error& e) {
+                throw std::runtime_error("Failed to parse streamed response: " + std::string(e.what()));
             }
-            
-            // Extract the generated text
-            if (response.contains("candidates") && 
-                !response["candidates"].empty() &&
-                response["candidates"][0].contains("content") &&
-                response["candidates"][0]["content"].contains("parts") &&
-                !response["candidates"][0]["content"]["parts"].empty() &&
-                response["candidates"][0]["content"]["parts"][0].contains("text")) {
-                
-                return response["candidates"][0]["content"]["parts"][0]["text"];
-            } else {
-                throw std::runtime_error("Could not extract commit message from Gemini response");
+            if (stream.had_events()) {
+                return usable_candidates(stream.candidates());
             }
-            
+            // Not an event stream: errors come back as a single JSON body
+            response_data = stream.body();
+        }
+        
+        // Parse JSON response
+        try {
+            std::vector<std::string> candidates = usable_candidates(candidate_texts(json::parse(response_data)));
+            on_text(candidates.front());
+            return candidates;
         } catch (const json::parse_error& e) {
             throw std::runtime_error("Failed to parse JSON response: " + std::string(e.what()));
         }
@@ -192,10 +860,20 @@ private:
         std::cout << "Apply this commit message? (y/n/redo) ";
         std::cout.flush();
         
-        // Set terminal to raw mode to read single character
-        system("stty raw -echo");
+        // Read a single character without waiting for Enter or echoing it
+        termios saved;
+        bool is_terminal = tcgetattr(STDIN_FILENO, &saved) == 0;
+        if (is_terminal) {
+            termios raw = saved;
+            raw.c_lflag &= ~(ICANON | ECHO);
+            raw.c_cc[VMIN] = 1;
+            raw.c_cc[VTIME] = 0;
+            tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+        }
         char choice = std::getchar();
-        system("stty cooked echo");
+        if (is_terminal) {
+            tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+        }
         
         // Print the character and move to new line
         std::cout << choice << std::endl;
@@ -203,56 +881,369 @@ private:
         return std::tolower(choice);
     }
     
+    // Suggestions already received for some staged changes live in
+    // $XDG_CACHE_HOME/fgit (~/.cache/fgit), one JSON file per set of staged
+    // changes, model and request body (which holds the prompt and the
+    // summarized diff). The cache is best effort: any problem with it just
+    // means a request.
+    fs::path cache_file(const std::string& payload) {
+        fs::path dir = cache_dir();
+        if (staged_key.empty() || dir.empty()) {
+            return {};
+        }
+        return dir / (staged_key + "-" + hash_text({gemini_model, payload}) + ".json");
+    }
+    
+    // FNV-1a 64 in hex, stable across runs and builds
+    static std::string hash_text(std::initializer_list<std::string_view> parts) {
+        uint64_t hash = 14695981039346656037ULL;
+        for (std::string_view part : parts) {
+            for (char c : part) {
+                hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+            }
+            hash = (hash ^ 0xff) * 1099511628211ULL;
+        }
+        char text[17];
+        std::snprintf(text, sizeof(text), "%016llx", static_cast<unsigned long long>(hash));
+        return text;
+    }
+    
+    static fs::path cache_dir() {
+        const char* cache_home = std::getenv("XDG_CACHE_HOME");
+        const char* home = std::getenv("HOME");
+        if (cache_home && *cache_home) {
+            return fs::path(cache_home) / "fgit";
+        }
+        if (home) {
+            return fs::path(home) / ".cache" / "fgit";
+        }
+        return {};
+    }
+    
+    // Decided before the diff is read, so that the connection can be warmed
+    // while git works: a request follows only if something is staged and
+    // nothing is cached for it. The staged changes are identified by the
+    // raw diff, which names the blobs before and after for every path
+    // without reading their content or writing anything to the repository.
+    // Also records staged_key for the cache.
+    bool request_expected() {
+        staged_key.clear();
+        std::string raw;
+        if (run_process({"git", "diff", "--cached", "--raw", "--no-abbrev", "-z"}, nullptr, &raw, true) != 0 ||
+            raw.empty()) {
+            return false;
+        }
+        staged_key = hash_text({raw});
+        
+        fs::path dir = cache_dir();
+        std::error_code error;
+        if (!dir.empty()) {
+            std::string prefix = staged_key + "-";
+            for (fs::directory_iterator it(dir, error), end; !error && it != end; it.increment(error)) {
+                if (it->path().filename().string().rfind(prefix, 0) == 0) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+    
+    static std::vector<std::string> load_cached_candidates(const fs::path& path) {
+        std::vector<std::string> candidates;
+        std::ifstream file(path);
+        if (!file.is_open()) {
+            return candidates;
+        }
+        try {
+            json cached = json::parse(file);
+            for (const auto& candidate : cached.at("candidates")) {
+                candidates.push_back(candidate.get<std::string>());
+            }
+        } catch (const std::exception&) {
+            candidates.clear(); // damaged or from another version: ignore it
+        }
+        return candidates;
+    }
+    
+    // Written to a temporary file and renamed, so readers never see half of it
+    static void save_cached_candidates(const fs::path& path, const std::vector<std::string>& candidates) {
+        std::error_code error;
+        fs::create_directories(path.parent_path(), error);
+        prune_cache(path.parent_path());
+        fs::path temp_path = path;
+        temp_path += ".tmp" + std::to_string(getpid());
+        {
+            std::ofstream file(temp_path);
+            file << json{{"candidates", candidates}}.dump();
+            if (!file) {
+                fs::remove(temp_path, error);
+                return;
+            }
+        }
+        fs::rename(temp_path, path, error);
+        if (error) {
+            fs::remove(temp_path, error);
+        }
+    }
+    
+    // Entries are only useful while their changes may still be staged: drop
+    // those untouched for cache_max_age, then the oldest beyond
+    // cache_max_entries
+    static constexpr auto cache_max_age = std::chrono::hours(24 * 30);
+    static constexpr size_t cache_max_entries = 200;
+    
+    static void prune_cache(const fs::path& dir) {
+        std::error_code error;
+        std::vector<std::pair<fs::file_time_type, fs::path>> entries;
+        auto now = fs::file_time_type::clock::now();
+        for (fs::directory_iterator it(dir, error), end; !error && it != end; it.increment(error)) {
+            std::error_code entry_error;
+            fs::file_time_type modified = it->last_write_time(entry_error);
+            if (entry_error || it->path().extension() != ".json") {
+                continue;
+            }
+            if (now - modified > cache_max_age) {
+                fs::remove(it->path(), entry_error);
+            } else {
+                entries.emplace_back(modified, it->path());
+            }
+        }
+        if (entries.size() >= cache_max_entries) {
+            std::sort(entries.begin(), entries.end());
+            for (size_t i = 0; i + cache_max_entries <= entries.size(); ++i) {
+                fs::remove(entries[i].second, error);
+            }
+        }
+    }
+    
     void perform_git_operations(const std::string& commit_message) {
         std::cout << "Proceeding with commit..." << std::endl;
         
         // Git commit (staged files are already staged)
         std::cout << "Running: git commit -m \"<message>\"" << std::endl;
         
-        // Create a temporary file for the commit message to avoid shell escaping issues
-        std::string temp_file = "/tmp/fgit_commit_msg.txt";
-        std::ofstream msg_file(temp_file);
-        msg_file << commit_message;
-        msg_file.close();
-        
-        std::string commit_cmd = "git commit -F " + temp_file;
-        if (execute_command_with_status(commit_cmd) != 0) {
-            fs::remove(temp_file);
+        // The message goes in on stdin, so it needs no escaping or temporary file
+        if (run_process({"git", "commit", "-F", "-"}, &commit_message, nullptr) != 0) {
             throw std::runtime_error("git commit failed");
         }
         
-        fs::remove(temp_file);
+        if (background_push) {
+            push_in_background();
+            return;
+        }
         
         // Git push
         std::cout << "Running: git push " << git_remote << " " << git_branch << std::endl;
-        std::string push_cmd = "git push " + git_remote + " " + git_branch;
-        if (execute_command_with_status(push_cmd) != 0) {
+        if (run_process({"git", "push", git_remote, git_branch}, nullptr, nullptr) != 0) {
             std::cerr << "Error: git push failed. Your commit was created locally, but not pushed." << std::endl;
+            cancel_warm_up();
             exit(1);
         }
         
         std::cout << "Commit created and pushed successfully!" << std::endl;
     }
     
+    // Background pushes. A detached worker waits a moment, so that commits
+    // made right after this one go out with it, then takes a lock on the
+    // repository (one push at a time) and pushes with retries. A worker
+    // whose commit an earlier push already carried has nothing to do, which
+    // is how quick successive commits end up in a single push. Push output
+    // goes to fgit-push.log in the git directory, and fgit-push.status holds
+    // the outcome of the last push.
+    static constexpr unsigned push_batch_seconds = 3;
+    static constexpr int push_attempts = 5;
+    
+    void push_in_background() {
+        // Every way out below exits or forks, and neither may happen while
+        // the warm-up is still using the handle
+        cancel_warm_up();
+        
+        std::string git_dir;
+        std::string commit;
+        try {
+            git_dir = output_line({"git", "rev-parse", "--absolute-git-dir"});
+            commit = output_line({"git", "rev-parse", "HEAD"});
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << ". Your commit was created locally, but not pushed." << std::endl;
+            exit(1);
+        }
+        
+        std::cout.flush();
+        std::cerr.flush();
+        
+        pid_t pid = fork();
+        if (pid < 0) {
+            std::cerr << "Error: could not start the push worker. Your commit was created locally, but not pushed." << std::endl;
+            exit(1);
+        }
+        if (pid == 0) {
+            // Detached from the terminal: output goes to the log, and git
+            // must fail rather than prompt for credentials
+            setsid();
+            int log = open((git_dir + "/fgit-push.log").c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+            int null = open("/dev/null", O_RDONLY);
+            if (log < 0 || null < 0) {
+                _exit(1);
+            }
+            dup2(null, STDIN_FILENO);
+            dup2(log, STDOUT_FILENO);
+            dup2(log, STDERR_FILENO);
+            setenv("GIT_TERMINAL_PROMPT", "0", 1);
+            int status = push_worker(git_dir, commit);
+            std::cout.flush();
+            _exit(status);
+        }
+        
+        std::cout << "Commit created. Pushing to " << git_remote << " " << git_branch
+                  << " in the background; see " << git_dir << "/fgit-push.log" << std::endl;
+    }
+    
+    int push_worker(const std::string& git_dir, const std::string& commit) {
+        auto log = [](const std::string& message) {
+            char stamp[32];
+            std::time_t now = std::time(nullptr);
+            std::strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", std::localtime(&now));
+            std::cout << "[" << stamp << "] " << message << std::endl;
+        };
+        auto set_status = [&git_dir](const std::string& status, const std::string& commit) {
+            std::ofstream((git_dir + "/fgit-push.status").c_str(), std::ios::trunc) << status << " " << commit << std::endl;
+        };
+        
+        sleep(push_batch_seconds);
+        int lock = open((git_dir + "/fgit-push.lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (lock < 0 || flock(lock, LOCK_EX) != 0) {
+            log("could not lock " + git_dir + "/fgit-push.lock");
+            return 1;
+        }
+        
+        // Merged into the tracking branch means a previous push carried it
+        std::string tracking = "refs/remotes/" + git_remote + "/" + git_branch;
+        if (run_process({"git", "merge-base", "--is-ancestor", commit, tracking}, nullptr, nullptr, true) == 0) {
+            log(commit.substr(0, 12) + " was already pushed with a later commit");
+            return 0;
+        }
+        
+        set_status("pushing", commit);
+        unsigned delay = 2;
+        for (int attempt = 1; attempt <= push_attempts; ++attempt) {
+            log("git push " + git_remote + " " + git_branch + " (attempt " + std::to_string(attempt) + " of " +
+                std::to_string(push_attempts) + ")");
+            std::cout.flush();
+            if (run_process({"git", "push", git_remote, git_branch}, nullptr, nullptr) == 0) {
+                // The branch tip went out, including any commits made meanwhile
+                std::string pushed = commit;
+                try {
+                    pushed = output_line({"git", "rev-parse", tracking});
+                } catch (const std::exception&) {
+                }
+                log("pushed up to " + pushed.substr(0, 12));
+                set_status("pushed", pushed);
+                return 0;
+            }
+            if (attempt < push_attempts) {
+                log("push failed, retrying in " + std::to_string(delay) + "s");
+                sleep(delay);
+                delay *= 2;
+            }
+        }
+        log("push failed; the commit is still local");
+        set_status("failed", commit);
+        return 1;
+    }
+    
+    // Tell the user about a background push that gave up since the last run
+    void report_failed_push() {
+        std::string git_dir;
+        try {
+            git_dir = output_line({"git", "rev-parse", "--absolute-git-dir"});
+        } catch (const std::exception&) {
+            return;
+        }
+        std::ifstream status_file(git_dir + "/fgit-push.status");
+        std::string status, commit;
+        if (status_file >> status >> commit && status == "failed") {
+            std::cerr << "Warning: the background push of " << commit.substr(0, 12) << " failed; see "
+                      << git_dir << "/fgit-push.log" << std::endl;
+        }
+    }
+    
 public:
+    ~FGit() {
+        cancel_warm_up();
+    }
+    
     void run() {
         try {
             // Initialize
             load_config();
             check_dependencies();
+            if (background_push) {
+                report_failed_push();
+            }
+            if (request_expected()) {
+                start_warm_up();
+            }
             
-            // Get git diff
+            // Get git diff. The summarizer needs all of it, so the payload
+            // is built once git is done rather than as the diff streams in.
             std::string diff_output = get_git_diff();
+            if (diff_output.empty()) {
+                return;
+            }
+            std::string payload = build_payload(diff_output);
+            
+            // Candidates received but not shown yet; a redo takes the next one.
+            // A rerun on the same staged changes starts with the cached ones.
+            std::deque<std::string> upcoming;
+            fs::path cache_path = cache_file(payload);
+            std::vector<std::string> received;
+            if (!cache_path.empty()) {
+                received = load_cached_candidates(cache_path);
+                upcoming.assign(received.begin(), received.end());
+                if (!received.empty()) {
+                    std::cout << "Using " << received.size() << " cached suggestion(s) for these staged changes." << std::endl;
+                }
+            }
             
             // Main interaction loop
             while (true) {
                 try {
-                    std::string suggested_message = call_gemini(diff_output);
+                    // The banner goes up with the first piece of text, which
+                    // is then shown as it arrives
+                    bool started = false;
+                    auto show = [&started](const std::string& text) {
+                        if (!started) {
+                            std::cout << "--------------------------------------------------" << std::endl;
+                            std::cout << "Suggested commit message:" << std::endl;
+                            std::cout << std::endl;
+                            started = true;
+                        }
+                        std::cout << text << std::flush;
+                    };
+                    
+                    std::string suggested_message;
+                    if (upcoming.empty()) {
+                        std::vector<std::string> candidates = call_gemini(payload, show);
+                        suggested_message = candidates.front();
+                        upcoming.assign(candidates.begin() + 1, candidates.end());
+                        if (!cache_path.empty()) {
+                            for (const std::string& candidate : candidates) {
+                                if (std::find(received.begin(), received.end(), candidate) == received.end()) {
+                                    received.push_back(candidate);
+                                }
+                            }
+                            save_cached_candidates(cache_path, received);
+                        }
+                        if (!started) {
+                            show(suggested_message); // the first candidate had no text
+                        }
+                    } else {
+                        suggested_message = upcoming.front();
+                        upcoming.pop_front();
+                        show(suggested_message);
+                    }
                     
-                    std::cout << "--------------------------------------------------" << std::endl;
-                    std::cout << "Suggested commit message:" << std::endl;
                     std::cout << std::endl;
-                    std::cout << suggested_message << std::endl;
                     std::cout << std::endl;
                     std::cout << "--------------------------------------------------" << std::endl;
                     
@@ -268,7 +1259,7 @@ public:
                             return;
                             
                         case 'r':
-                            std::cout << "Requesting a new suggestion..." << std::endl;
+                            std::cout << (upcoming.empty() ? "Requesting a new suggestion..." : "Showing the next candidate...") << std::endl;
                             break; // Continue loop
                             
                         default:
@@ -279,12 +1270,14 @@ public:
                 } catch (const std::exception& e) {
                     std::cerr << "Failed to get suggestion from Gemini: " << e.what() << std::endl;
                     std::cerr << "Aborting." << std::endl;
+                    cancel_warm_up();
                     exit(1);
                 }
             }
             
         } catch (const std::exception& e) {
             std::cerr << "Error: " << e.what() << std::endl;
+            cancel_warm_up();
             exit(1);
         }
     }
@@ -294,8 +1287,11 @@ int main() {
     // Initialize curl globally
     curl_global_init(CURL_GLOBAL_DEFAULT);
     
-    FGit fgit;
-    fgit.run();
+    {
+        // Destroyed before the global cleanup, along with its curl handle
+        FGit fgit;
+        fgit.run();
+    }
     
     // Clean up curl
     curl_global_cleanup();
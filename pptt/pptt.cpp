@@ -9,403 +9,3552 @@
 #include <map>
 #include <sstream>
 #include <cctype>
+#include <cstdlib>
 #include <regex>
 #include <unistd.h> // for getopt
-#include <iomanip>
+#include <getopt.h> // for getopt_long
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <string_view>
+#include <utility>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <chrono>
+#include <memory>
+#include <array>
+#include <future>
+#include <unordered_map>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#endif
+#ifdef PPTT_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 namespace fs = std::filesystem;
 
+// How a filter is evaluated. Patterns that are plain literals (optionally
+// anchored with ^ or $) never touch std::regex.
+enum class PatternKind {
+    Substring,
+    Prefix,
+    Suffix,
+    Exact,
+    Regex
+};
+
 struct PatternFilter {
     std::string pattern;
     bool is_include; // true for -e, false for -v
+    PatternKind kind;
+    std::string literal; // unescaped text for the literal kinds
+    std::regex regex;    // compiled once, only used for PatternKind::Regex
+};
+
+struct CommentStyle {
+    std::string_view single_line;
+    std::string_view multi_start;
+    std::string_view multi_end;
+    bool has_comments;
+};
+
+struct BuiltinStyle {
+    std::string_view extension; // lowercase, with the dot
+    CommentStyle style;
+};
+
+// Comment styles lookup table
+static constexpr BuiltinStyle builtin_styles[] = {
+    {".cpp", {"//", "/*", "*/", true}},
+    {".c", {"//", "/*", "*/", true}},
+    {".h", {"//", "/*", "*/", true}},
+    {".hpp", {"//", "/*", "*/", true}},
+    {".swift", {"//", "/*", "*/", true}},
+    {".sh", {"#", "", "", true}},
+    {".bash", {"#", "", "", true}},
+    {".py", {"#", "'''", "'''", true}},
+    {".js", {"//", "/*", "*/", true}},
+    {".ts", {"//", "/*", "*/", true}},
+    {".java", {"//", "/*", "*/", true}},
+    {".cs", {"//", "/*", "*/", true}},
+    {".go", {"//", "/*", "*/", true}},
+    {".php", {"//", "/*", "*/", true}},
+    {".rb", {"#", "=begin", "=end", true}},
+    {".rs", {"//", "/*", "*/", true}},
+    {".lua", {"--", "--[[", "]]", true}},
+    {".html", {"", "<!--", "-->", true}},
+    {".xml", {"", "<!--", "-->", true}},
+    {".yaml", {"#", "", "", true}},
+    {".yml", {"#", "", "", true}},
+    {".json", {"", "", "", false}},
+    {".ini", {"#", "", "", true}},
+    {".sql", {"--", "/*", "*/", true}},
+    {".tex", {"%", "", "", true}},
+    {".md", {"", "", "", false}},
+    {".cmake", {"#", "", "", true}},
+    {".txt", {"", "", "", false}},
+    {".proto", {"//", "/*", "*/", true}},
+    {".ex", {"#", "", "", true}},
+    {".exs", {"#", "", "", true}},
+    {".pl", {"#", "", "", true}}
+};
+
+constexpr size_t builtin_style_count = sizeof(builtin_styles) / sizeof(builtin_styles[0]);
+
+// Perfect hash of the built-in extensions: FNV-1a with a seed searched at
+// compile time so that every extension lands in its own slot
+constexpr size_t style_slot_count = 128;
+constexpr uint8_t no_style = 0xff;
+
+constexpr uint32_t style_hash(std::string_view extension, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ seed;
+    for (char c : extension) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 16777619u;
+    }
+    // The low bits of FNV only depend on the low bits of the seed; mix the
+    // high ones down
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    return hash % style_slot_count;
+}
+
+constexpr uint32_t find_style_seed() {
+    for (uint32_t seed = 0; seed < 100000; ++seed) {
+        bool used[style_slot_count] = {};
+        bool collision = false;
+        for (const auto& builtin : builtin_styles) {
+            uint32_t slot = style_hash(builtin.extension, seed);
+            collision = collision || used[slot];
+            used[slot] = true;
+        }
+        if (!collision) {
+            return seed;
+        }
+    }
+    return UINT32_MAX;
+}
+
+constexpr uint32_t style_seed = find_style_seed();
+static_assert(style_seed != UINT32_MAX, "no perfect hash seed for the comment style table");
+
+constexpr std::array<uint8_t, style_slot_count> make_style_slots() {
+    std::array<uint8_t, style_slot_count> slots{};
+    for (auto& slot : slots) {
+        slot = no_style;
+    }
+    for (size_t i = 0; i < builtin_style_count; ++i) {
+        slots[style_hash(builtin_styles[i].extension, style_seed)] = static_cast<uint8_t>(i);
+    }
+    return slots;
+}
+
+constexpr std::array<uint8_t, style_slot_count> style_slots = make_style_slots();
+
+// Longest extension in the table, so that longer ones are rejected unread
+constexpr size_t max_style_extension() {
+    size_t longest = 0;
+    for (const auto& builtin : builtin_styles) {
+        longest = std::max(longest, builtin.extension.size());
+    }
+    return longest;
+}
+
+// Extension of a path's file name, as fs::path::extension() gives it,
+// viewed in place: empty for "name", ".hidden", "." and ".."
+static std::string_view extension_of(std::string_view path) {
+    size_t slash = path.rfind('/');
+    std::string_view name = slash == std::string_view::npos ? path : path.substr(slash + 1);
+    if (name == "." || name == "..") {
+        return {};
+    }
+    size_t dot = name.rfind('.');
+    return dot == std::string_view::npos || dot == 0 ? std::string_view() : name.substr(dot);
+}
+
+// Comment styles by extension, with their header and footer banners
+// formatted once. The built-in table above is used as is; a --styles file
+// adds or replaces entries.
+class CommentStyles {
+public:
+    struct Style {
+        std::string extension;
+        CommentStyle comment;
+        std::string header_open;  // banner lines up to the displayed path
+        std::string header_close; // the rest of the header after the path
+        std::string footer;
+    };
+    
+    CommentStyles() : fallback(make_style("", {"", "", "", false})) {
+        for (const auto& builtin : builtin_styles) {
+            styles.push_back(make_style(std::string(builtin.extension), builtin.style));
+        }
+    }
+    
+    // The style of an extension as extension_of() returns it, or null if
+    // there is none. Doesn't allocate.
+    const Style* find(std::string_view extension) const {
+        size_t limit = std::max(max_extension, max_style_extension());
+        if (extension.empty() || extension.size() > limit) {
+            return nullptr;
+        }
+        char lower[64];
+        size_t length = std::min(extension.size(), sizeof(lower));
+        for (size_t i = 0; i < length; ++i) {
+            lower[i] = static_cast<char>(std::tolower(static_cast<unsigned char>(extension[i])));
+        }
+        std::string_view key(lower, length);
+        
+        for (size_t i = builtin_style_count; i < styles.size(); ++i) {
+            if (styles[i].extension == key) {
+                return &styles[i];
+            }
+        }
+        uint8_t index = style_slots[style_hash(key, style_seed)];
+        if (index != no_style && styles[index].extension == key) {
+            return &styles[index];
+        }
+        return nullptr;
+    }
+    
+    // Banners for files without a known comment style
+    const Style& plain() const {
+        return fallback;
+    }
+    
+    // Each line of a styles file is
+    //   .ext SINGLE_LINE [MULTI_START MULTI_END]
+    // with "-" for a marker the language doesn't have; blank lines and
+    // lines starting with # are skipped
+    bool load(const fs::path& path, std::string& error) {
+        std::ifstream file(path);
+        if (!file) {
+            error = "cannot open " + path.string();
+            return false;
+        }
+        std::string line;
+        for (int number = 1; std::getline(file, line); ++number) {
+            std::istringstream fields(line);
+            std::string extension;
+            if (!(fields >> extension) || extension[0] == '#') {
+                continue;
+            }
+            std::string markers[3];
+            for (auto& marker : markers) {
+                if (fields >> marker && marker == "-") {
+                    marker.clear();
+                }
+            }
+            std::string rest;
+            if (extension.size() < 2 || extension[0] != '.' || extension.size() > 64 || fields >> rest ||
+                markers[1].empty() != markers[2].empty()) {
+                error = path.string() + ":" + std::to_string(number) + ": expected '.ext SINGLE [START END]'";
+                return false;
+            }
+            std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+            add(extension, std::move(markers[0]), std::move(markers[1]), std::move(markers[2]));
+        }
+        return true;
+    }
+    
+private:
+    std::deque<Style> styles; // built-ins first, at their table index
+    std::deque<std::string> markers; // storage for loaded styles' views
+    Style fallback;
+    size_t max_extension = 0; // longest loaded extension
+    
+    static Style make_style(std::string extension, const CommentStyle& comment) {
+        Style style{std::move(extension), comment, "", "", ""};
+        if (comment.has_comments && !comment.single_line.empty()) {
+            // Use single-line comments
+            std::string marker(comment.single_line);
+            style.header_open = marker + " ========================================================\n" + marker + "  File: ";
+            style.header_close = "\n" + marker + "  <content> ----------------------------------------------\n";
+            style.footer = marker + "  </content> ----------------------------------------------\n";
+        } else {
+            // Fallback to original format for files without comments
+            style.header_open = "===================================\nFile: ";
+            style.header_close = "\n<content> -------------------------\n";
+            style.footer = "</content> ------------------------\n";
+        }
+        return style;
+    }
+    
+    void add(const std::string& extension, std::string single_line, std::string multi_start, std::string multi_end) {
+        std::string_view views[3];
+        std::string* texts[3] = {&single_line, &multi_start, &multi_end};
+        for (int i = 0; i < 3; ++i) {
+            markers.push_back(std::move(*texts[i]));
+            views[i] = markers.back();
+        }
+        CommentStyle comment{views[0], views[1], views[2], !views[0].empty() || !views[1].empty()};
+        Style style = make_style(extension, comment);
+        
+        uint8_t index = style_slots[style_hash(extension, style_seed)];
+        if (index != no_style && styles[index].extension == extension) {
+            styles[index] = std::move(style);
+            return;
+        }
+        for (size_t i = builtin_style_count; i < styles.size(); ++i) {
+            if (styles[i].extension == extension) {
+                styles[i] = std::move(style);
+                return;
+            }
+        }
+        styles.push_back(std::move(style));
+        max_extension = std::max(max_extension, extension.size());
+    }
+};
+
+// Owns a POSIX file descriptor
+class UniqueFd {
+public:
+    UniqueFd() = default;
+    explicit UniqueFd(int fd) : fd(fd) {}
+    UniqueFd(UniqueFd&& other) noexcept : fd(std::exchange(other.fd, -1)) {}
+    UniqueFd& operator=(UniqueFd&& other) noexcept {
+        if (this != &other) {
+            reset();
+            fd = std::exchange(other.fd, -1);
+        }
+        return *this;
+    }
+    UniqueFd(const UniqueFd&) = delete;
+    UniqueFd& operator=(const UniqueFd&) = delete;
+    ~UniqueFd() { reset(); }
+    
+    int get() const { return fd; }
+    explicit operator bool() const { return fd >= 0; }
+    
+    void reset() {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        fd = -1;
+    }
+    
+private:
+    int fd = -1;
+};
+
+// Read-only mapping of a whole file. view() is empty if mapping failed.
+class MappedFile {
+public:
+    MappedFile(int fd, size_t size) : size(size) {
+        if (size > 0) {
+            data = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                ::madvise(data, size, MADV_SEQUENTIAL);
+            }
+        }
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() {
+        if (data != MAP_FAILED) {
+            ::munmap(data, size);
+        }
+    }
+    
+    bool is_mapped() const { return data != MAP_FAILED; }
+    std::string_view view() const {
+        return is_mapped() ? std::string_view(static_cast<const char*>(data), size) : std::string_view();
+    }
+    
+private:
+    void* data = MAP_FAILED;
+    size_t size;
+};
+
+// Limits from --max-bytes/--max-lines on what one target prints, and what
+// has been used so far. A zero limit means unlimited.
+struct OutputBudget {
+    uint64_t max_bytes = 0;
+    uint64_t max_lines = 0;
+    uint64_t bytes = 0;
+    uint64_t lines = 0;
+    bool exhausted = false;
+    bool cut_short = false; // the last block was printed in part
+    
+    bool limited() const { return max_bytes > 0 || max_lines > 0; }
+    uint64_t bytes_left() const {
+        return max_bytes == 0 ? UINT64_MAX : (bytes < max_bytes ? max_bytes - bytes : 0);
+    }
+    uint64_t lines_left() const {
+        return max_lines == 0 ? UINT64_MAX : (lines < max_lines ? max_lines - lines : 0);
+    }
+};
+
+// Modification time of a stat result in nanoseconds
+static int64_t mtime_ns(const struct stat& info) {
+#ifdef __APPLE__
+    return static_cast<int64_t>(info.st_mtimespec.tv_sec) * 1000000000 + info.st_mtimespec.tv_nsec;
+#else
+    return static_cast<int64_t>(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+#endif
+}
+
+// Nanoseconds since start, for --stats
+static uint64_t elapsed_ns(std::chrono::steady_clock::time_point start) {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count());
+}
+
+enum class EntryType : uint8_t {
+    File,
+    Directory,
+    Symlink, // resolved with a stat every time, the target may change
+    Other
+};
+
+// One visible (non-hidden) directory entry as listed by readdir
+struct ListedEntry {
+    std::string name;
+    EntryType type;
+};
+
+// What we learned about a file last time its content was looked at
+struct FileFacts {
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    uint64_t inode = 0;
+    bool binary = false;
+    int64_t line_count = -1; // -1 if never counted
+};
+
+// Bodies at least this large are streamed or mapped from the file instead
+// of being read into memory
+static constexpr size_t stream_body_threshold = 256 * 1024;
+
+// Bytes looked at to decide whether a file is binary
+static constexpr size_t binary_sniff_size = 512;
+
+// One file of the content section, ready to be written. Small bodies are
+// read into `body`; large ones stay open in `body_fd` and are copied by
+// the kernel when the block is written.
+struct FileBlock {
+    std::string head;
+    std::string body;
+    UniqueFd body_fd;
+    size_t body_size = 0;
+    std::string tail;
+    
+    // Filled in with --dedup, to find earlier copies of the content and
+    // turn the block into a reference to one
+    bool hashed = false;
+    uint64_t content_hash = 0;
+    uint64_t content_size = 0;
+    int64_t lines = -1;
+    // Newlines in a streamed body when the cache knows its line count, so
+    // --max-lines doesn't have to map the file to count them
+    int64_t body_newlines = -1;
+    fs::path source;
+    std::string display_path; // as in the header
+    // The raw content, for the comparison with earlier copies: the mapping
+    // a large file was hashed from, or a copy of a small body that gets
+    // numbered or escaped
+    std::unique_ptr<MappedFile> content_map;
+    std::string raw_content;
+    
+    size_t size() const { return head.size() + body.size() + body_size + tail.size(); }
+};
+
+// XXH64 from the xxHash family: a fast non-cryptographic hash, used by
+// --dedup to spot repeated file bodies. Gives the reference results on
+// little-endian machines.
+static uint64_t xxh64(std::string_view data, uint64_t seed = 0) {
+    constexpr uint64_t prime1 = 11400714785074694791ULL;
+    constexpr uint64_t prime2 = 14029467366897019727ULL;
+    constexpr uint64_t prime3 = 1609587929392839161ULL;
+    constexpr uint64_t prime4 = 9650029242287828579ULL;
+    constexpr uint64_t prime5 = 2870177450012600261ULL;
+    
+    auto rotl = [](uint64_t value, int bits) { return (value << bits) | (value >> (64 - bits)); };
+    auto read64 = [](const char* p) { uint64_t value; std::memcpy(&value, p, 8); return value; };
+    auto read32 = [](const char* p) { uint32_t value; std::memcpy(&value, p, 4); return value; };
+    auto round = [&](uint64_t acc, uint64_t input) { return rotl(acc + input * prime2, 31) * prime1; };
+    auto merge = [&](uint64_t acc, uint64_t value) { return (acc ^ round(0, value)) * prime1 + prime4; };
+    
+    const char* p = data.data();
+    const char* end = p + data.size();
+    uint64_t hash;
+    if (data.size() >= 32) {
+        uint64_t v1 = seed + prime1 + prime2;
+        uint64_t v2 = seed + prime2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - prime1;
+        do {
+            v1 = round(v1, read64(p));
+            v2 = round(v2, read64(p + 8));
+            v3 = round(v3, read64(p + 16));
+            v4 = round(v4, read64(p + 24));
+            p += 32;
+        } while (end - p >= 32);
+        hash = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        hash = merge(hash, v1);
+        hash = merge(hash, v2);
+        hash = merge(hash, v3);
+        hash = merge(hash, v4);
+    } else {
+        hash = seed + prime5;
+    }
+    hash += data.size();
+    
+    for (; end - p >= 8; p += 8) {
+        hash = rotl(hash ^ round(0, read64(p)), 27) * prime1 + prime4;
+    }
+    if (end - p >= 4) {
+        hash = rotl(hash ^ (read32(p) * prime1), 23) * prime2 + prime3;
+        p += 4;
+    }
+    for (; p < end; ++p) {
+        hash = rotl(hash ^ (static_cast<unsigned char>(*p) * prime5), 11) * prime1;
+    }
+    
+    hash ^= hash >> 33;
+    hash *= prime2;
+    hash ^= hash >> 29;
+    hash *= prime3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+// Substring search for -c/-C literals. Compares the needle's first and
+// last bytes at 16 candidate positions at a time and only runs memcmp
+// where both agree, which rules out nearly every position in text.
+static size_t find_literal(std::string_view haystack, std::string_view needle) {
+    size_t length = needle.size();
+    if (length <= 1 || length > haystack.size()) {
+        return haystack.find(needle);
+    }
+    size_t i = 0;
+#ifdef __SSE2__
+    const char* text = haystack.data();
+    size_t candidates = haystack.size() - length + 1;
+    const __m128i first = _mm_set1_epi8(needle.front());
+    const __m128i last = _mm_set1_epi8(needle.back());
+    for (; i + 16 <= candidates; i += 16) {
+        __m128i starts = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i));
+        __m128i ends = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i + length - 1));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(
+                _mm_and_si128(_mm_cmpeq_epi8(starts, first), _mm_cmpeq_epi8(ends, last))));
+        while (mask != 0) {
+            unsigned offset = static_cast<unsigned>(__builtin_ctz(mask));
+            if (std::memcmp(text + i + offset + 1, needle.data() + 1, length - 2) == 0) {
+                return i + offset;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+    size_t found = haystack.substr(i).find(needle);
+    return found == std::string_view::npos ? found : i + found;
+}
+
+// A file opened once for both the binary sniff and the body. load_start()
+// reads only the first block, which is all the sniff needs; load_rest()
+// then reads the remainder of a small file, so binary files are never read
+// past their first block. A large file's body is later streamed or mapped
+// from the same descriptor instead.
+class SourceFile {
+public:
+    explicit SourceFile(const fs::path& path)
+        : fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC)) {
+        struct stat info;
+        if (fd && ::fstat(fd.get(), &info) == 0) {
+            file_size = static_cast<size_t>(info.st_size);
+            modified = mtime_ns(info);
+            inode = static_cast<uint64_t>(info.st_ino);
+            large = S_ISREG(info.st_mode) && file_size >= stream_body_threshold;
+        } else {
+            fd.reset();
+        }
+    }
+    
+    bool is_open() const { return static_cast<bool>(fd); }
+    bool is_large() const { return large; }
+    size_t size() const { return file_size; }
+    
+    // Whether cached facts still describe this file
+    bool matches(const FileFacts& facts) const {
+        return facts.size == file_size && facts.mtime == modified && facts.inode == inode;
+    }
+    
+    FileFacts facts(bool binary, int64_t line_count) const {
+        return FileFacts{file_size, modified, inode, binary, line_count};
+    }
+    int descriptor() const { return fd.get(); }
+    UniqueFd release() { return std::move(fd); }
+    
+    // Append the first binary_sniff_size bytes (fewer if the file is shorter)
+    void load_start(std::string& data) {
+        size_t used = data.size();
+        data.resize(used + binary_sniff_size);
+        size_t got = 0;
+        while (got < binary_sniff_size) {
+            ssize_t n = large ? ::pread(fd.get(), &data[used + got], binary_sniff_size - got, static_cast<off_t>(got))
+                              : ::read(fd.get(), &data[used + got], binary_sniff_size - got);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            got += static_cast<size_t>(n);
+        }
+        data.resize(used + got);
+        started = got;
+    }
+    
+    // After load_start: append the rest of a small file. Large files stay
+    // on disk.
+    void load_rest(std::string& data) {
+        if (!large) {
+            read_all(data);
+        }
+    }
+    
+    // Append the whole file, or only its first block if it is large
+    void load(std::string& data) {
+        load_start(data);
+        load_rest(data);
+    }
+    
+private:
+    UniqueFd fd;
+    size_t file_size = 0;
+    int64_t modified = 0;
+    uint64_t inode = 0;
+    bool large = false;
+    size_t started = 0; // bytes already read by load_start
+    
+    // st_size only sizes the first read; keep going until EOF
+    void read_all(std::string& out) {
+        size_t used = out.size();
+        out.resize(used + (file_size > started ? file_size - started : 0) + 1);
+        while (true) {
+            if (used == out.size()) {
+                out.resize(out.size() * 2);
+            }
+            ssize_t got = ::read(fd.get(), &out[used], out.size() - used);
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                break;
+            }
+            used += static_cast<size_t>(got);
+        }
+        out.resize(used);
+    }
+};
+
+// Buffered stdout writer that bypasses iostreams. File bodies go out with
+// sendfile where the kernel supports it for stdout, otherwise they are
+// mapped and written together with the pending buffer and footer in one
+// writev.
+class OutputWriter {
+public:
+    explicit OutputWriter(int fd = STDOUT_FILENO) : fd(fd) {
+        buffer.reserve(buffer_capacity);
+    }
+    
+    ~OutputWriter() {
+        flush();
+#ifdef PPTT_HAVE_ZSTD
+        ZSTD_freeCCtx(zstd);
+#endif
+    }
+    
+    // --compress=zstd: compress everything from here on. A frame ends at
+    // the first file boundary after frame_size bytes of input and at every
+    // flush, so frames always hold whole files. workers > 0 compresses on
+    // that many extra threads. Returns false with error set if this build
+    // has no zstd or zstd rejects the settings.
+    bool enable_zstd(int level, int workers, std::string& error) {
+#ifdef PPTT_HAVE_ZSTD
+        flush();
+        zstd = ZSTD_createCCtx();
+        if (!zstd) {
+            error = "could not create a zstd context";
+            return false;
+        }
+        size_t result = ZSTD_CCtx_setParameter(zstd, ZSTD_c_compressionLevel, level);
+        if (!ZSTD_isError(result) && workers > 0) {
+            result = ZSTD_CCtx_setParameter(zstd, ZSTD_c_nbWorkers, workers);
+        }
+        if (ZSTD_isError(result)) {
+            error = ZSTD_getErrorName(result);
+            ZSTD_freeCCtx(zstd);
+            zstd = nullptr;
+            return false;
+        }
+        compressed.resize(ZSTD_CStreamOutSize());
+        return true;
+#else
+        (void)level;
+        (void)workers;
+        error = "this pptt was built without zstd support";
+        return false;
+#endif
+    }
+    
+    // Everything handed to the writer so far, flushed or not
+    uint64_t bytes_written() const {
+        return total_bytes;
+    }
+    
+    // What actually reached the file descriptor (after compression), and
+    // with timing on, how long the write calls took
+    uint64_t device_bytes() const { return written_bytes; }
+    uint64_t write_time_ns() const { return write_ns; }
+    void set_timing(bool value) { timing = value; }
+    
+    void write(std::string_view data) {
+        total_bytes += data.size();
+        if (buffer.size() + data.size() > buffer_capacity) {
+            drain();
+            if (data.size() >= buffer_capacity) {
+                emit(data.data(), data.size());
+                return;
+            }
+        }
+        buffer.append(data);
+    }
+    
+    void write_block(const FileBlock& block) {
+        write(block.head);
+        write(block.body);
+        if (block.body_fd) {
+            write_file(block.body_fd.get(), block.body_size, block.tail);
+        } else {
+            write(block.tail);
+        }
+#ifdef PPTT_HAVE_ZSTD
+        if (zstd && frame_input + buffer.size() >= frame_size) {
+            flush();
+        }
+#endif
+    }
+    
+    // Write out everything buffered and end the current zstd frame
+    void flush() {
+        drain();
+#ifdef PPTT_HAVE_ZSTD
+        if (zstd && frame_input > 0) {
+            compress(nullptr, 0, ZSTD_e_end);
+            frame_input = 0;
+        }
+#endif
+    }
+    
+private:
+    static constexpr size_t buffer_capacity = 256 * 1024;
+    
+    int fd;
+    std::string buffer;
+    uint64_t total_bytes = 0;
+    uint64_t written_bytes = 0;
+    uint64_t write_ns = 0;
+    bool timing = false;      // --stats
+    bool use_sendfile = true; // cleared once stdout turns out not to support it
+    bool failed = false;      // stop writing after an error such as EPIPE
+    
+    // Adds the time spent in the write calls of its scope to write_ns
+    class WriteTimer {
+    public:
+        explicit WriteTimer(OutputWriter& writer) : writer(writer) {
+            if (writer.timing) {
+                start = std::chrono::steady_clock::now();
+            }
+        }
+        ~WriteTimer() {
+            if (writer.timing) {
+                writer.write_ns += elapsed_ns(start);
+            }
+        }
+    private:
+        OutputWriter& writer;
+        std::chrono::steady_clock::time_point start;
+    };
+    
+#ifdef PPTT_HAVE_ZSTD
+    static constexpr uint64_t frame_size = 1024 * 1024;
+    
+    ZSTD_CCtx* zstd = nullptr;
+    std::string compressed;   // output buffer of the compressor
+    uint64_t frame_input = 0; // uncompressed bytes in the open frame
+    
+    void compress(const char* data, size_t size, ZSTD_EndDirective mode) {
+        ZSTD_inBuffer input{data, size, 0};
+        bool done = false;
+        while (!done && !failed) {
+            ZSTD_outBuffer output{compressed.data(), compressed.size(), 0};
+            size_t remaining = ZSTD_compressStream2(zstd, &output, &input, mode);
+            if (ZSTD_isError(remaining)) {
+                std::cerr << "Error: zstd: " << ZSTD_getErrorName(remaining) << std::endl;
+                failed = true;
+                return;
+            }
+            write_all(compressed.data(), output.pos);
+            done = mode == ZSTD_e_end ? remaining == 0 : input.pos == input.size;
+        }
+        frame_input += size;
+    }
+#endif
+    
+    // Send bytes on, through the compressor if there is one
+    void emit(const char* data, size_t size) {
+#ifdef PPTT_HAVE_ZSTD
+        if (zstd) {
+            compress(data, size, ZSTD_e_continue);
+            return;
+        }
+#endif
+        write_all(data, size);
+    }
+    
+    // Write out the buffer without ending a frame
+    void drain() {
+        emit(buffer.data(), buffer.size());
+        buffer.clear();
+    }
+    
+    bool compressing() const {
+#ifdef PPTT_HAVE_ZSTD
+        return zstd != nullptr;
+#else
+        return false;
+#endif
+    }
+    
+    void write_all(const char* data, size_t size) {
+        WriteTimer timer(*this);
+        while (size > 0 && !failed) {
+            ssize_t written = ::write(fd, data, size);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                failed = true;
+                return;
+            }
+            data += written;
+            size -= static_cast<size_t>(written);
+            written_bytes += static_cast<uint64_t>(written);
+        }
+    }
+    
+    void writev_all(struct iovec* iov, int count) {
+        WriteTimer timer(*this);
+        while (count > 0 && !failed) {
+            ssize_t written = ::writev(fd, iov, count);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                failed = true;
+                return;
+            }
+            size_t remaining = static_cast<size_t>(written);
+            written_bytes += remaining;
+            while (count > 0 && remaining >= iov->iov_len) {
+                remaining -= iov->iov_len;
+                ++iov;
+                --count;
+            }
+            if (count > 0) {
+                iov->iov_base = static_cast<char*>(iov->iov_base) + remaining;
+                iov->iov_len -= remaining;
+            }
+        }
+    }
+    
+    // Write `size` bytes of in_fd followed by `trailer`
+    void write_file(int in_fd, size_t size, std::string_view trailer) {
+        off_t offset = 0;
+        total_bytes += size;
+        
+#ifdef __linux__
+        if (use_sendfile && !compressing()) {
+            drain();
+            WriteTimer timer(*this);
+            while (static_cast<size_t>(offset) < size && !failed) {
+                ssize_t sent = ::sendfile(fd, in_fd, &offset, size - static_cast<size_t>(offset));
+                if (sent < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    if ((errno == EINVAL || errno == ENOSYS) && offset == 0) {
+                        use_sendfile = false;
+                        break;
+                    }
+                    failed = true;
+                    return;
+                }
+                if (sent == 0) {
+                    break; // file shrank underneath us
+                }
+                written_bytes += static_cast<uint64_t>(sent);
+            }
+            if (use_sendfile) {
+                write(trailer);
+                return;
+            }
+        }
+#endif
+        
+        MappedFile mapped(in_fd, size);
+        if (mapped.is_mapped() && compressing()) {
+            std::string_view body = mapped.view();
+            drain();
+            emit(body.data(), body.size());
+            write(trailer);
+            return;
+        }
+        if (mapped.is_mapped()) {
+            std::string_view body = mapped.view();
+            struct iovec iov[3] = {
+                {buffer.data(), buffer.size()},
+                {const_cast<char*>(body.data()), body.size()},
+                {const_cast<char*>(trailer.data()), trailer.size()}
+            };
+            writev_all(iov, 3);
+            buffer.clear();
+            total_bytes += trailer.size();
+            return;
+        }
+        
+        // Last resort: plain reads through the buffer
+        total_bytes -= size; // counted again by write()
+        char chunk[64 * 1024];
+        ssize_t got;
+        while ((got = ::pread(in_fd, chunk, sizeof(chunk), offset)) != 0) {
+            if (got < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            write(std::string_view(chunk, static_cast<size_t>(got)));
+            offset += got;
+        }
+        write(trailer);
+    }
+};
+
+// On-disk index of a previous scan, stored as .pptt-cache in the base
+// directory. A directory whose mtime is unchanged is not read again; its
+// cached listing is used instead. File facts are only trusted while the
+// file's size, mtime and inode still match. The format is a private,
+// host-endian binary dump; anything unexpected just starts a cold cache.
+class ScanCache {
+public:
+    static constexpr const char* file_name = ".pptt-cache";
+    
+    explicit ScanCache(fs::path path) : path(std::move(path)) {
+        scan_started = static_cast<int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count());
+    }
+    
+    void load() {
+        std::ifstream in(path, std::ios::binary);
+        if (!in) {
+            return;
+        }
+        
+        char magic[sizeof(format_magic) - 1];
+        if (!in.read(magic, sizeof(magic)) || std::string_view(magic, sizeof(magic)) != format_magic) {
+            return;
+        }
+        
+        std::unordered_map<std::string, CachedDirectory> loaded_directories;
+        std::unordered_map<std::string, FileFacts> loaded_files;
+        
+        uint32_t directory_count = 0;
+        if (!read_value(in, directory_count)) {
+            return;
+        }
+        for (uint32_t i = 0; i < directory_count; ++i) {
+            std::string dir_path;
+            CachedDirectory dir;
+            uint32_t entry_count = 0;
+            if (!read_string(in, dir_path) || !read_value(in, dir.mtime) || !read_value(in, entry_count)) {
+                return;
+            }
+            dir.entries.resize(entry_count);
+            for (auto& entry : dir.entries) {
+                if (!read_string(in, entry.name) || !read_value(in, entry.type)) {
+                    return;
+                }
+            }
+            loaded_directories.emplace(std::move(dir_path), std::move(dir));
+        }
+        
+        uint32_t file_count = 0;
+        if (!read_value(in, file_count)) {
+            return;
+        }
+        for (uint32_t i = 0; i < file_count; ++i) {
+            std::string file_path;
+            FileFacts facts;
+            if (!read_string(in, file_path) || !read_value(in, facts.size) || !read_value(in, facts.mtime) ||
+                !read_value(in, facts.inode) || !read_value(in, facts.binary) || !read_value(in, facts.line_count)) {
+                return;
+            }
+            loaded_files.emplace(std::move(file_path), facts);
+        }
+        
+        previous_directories = std::move(loaded_directories);
+        files = std::move(loaded_files);
+    }
+    
+    // Write the directories seen in this run, and the facts of files that
+    // are still listed in them. Nothing is written if nothing changed.
+    void save() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!dirty && current_directories.size() == previous_directories.size()) {
+            return;
+        }
+        
+        fs::path temp_path = path;
+        temp_path += ".tmp";
+        std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            return;
+        }
+        
+        out.write(format_magic, sizeof(format_magic) - 1);
+        write_value(out, static_cast<uint32_t>(current_directories.size()));
+        for (const auto& [dir_path, dir] : current_directories) {
+            write_string(out, dir_path);
+            write_value(out, dir.mtime);
+            write_value(out, static_cast<uint32_t>(dir.entries.size()));
+            for (const auto& entry : dir.entries) {
+                write_string(out, entry.name);
+                write_value(out, entry.type);
+            }
+        }
+        
+        std::vector<std::pair<const std::string*, const FileFacts*>> live_files;
+        for (const auto& [file_path, facts] : files) {
+            if (is_listed(file_path)) {
+                live_files.emplace_back(&file_path, &facts);
+            }
+        }
+        write_value(out, static_cast<uint32_t>(live_files.size()));
+        for (const auto& [file_path, facts] : live_files) {
+            write_string(out, *file_path);
+            write_value(out, facts->size);
+            write_value(out, facts->mtime);
+            write_value(out, facts->inode);
+            write_value(out, facts->binary);
+            write_value(out, facts->line_count);
+        }
+        
+        out.close();
+        std::error_code error;
+        if (out) {
+            fs::rename(temp_path, path, error);
+        } else {
+            fs::remove(temp_path, error);
+        }
+    }
+    
+    // Cached listing of a directory, if it was cached with this mtime
+    bool find_directory(const std::string& dir_path, int64_t mtime, std::vector<ListedEntry>& entries) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = previous_directories.find(dir_path);
+        if (it == previous_directories.end() || it->second.mtime != mtime) {
+            return false;
+        }
+        entries = it->second.entries;
+        current_directories[dir_path] = it->second;
+        return true;
+    }
+    
+    void store_directory(const std::string& dir_path, int64_t mtime, const std::vector<ListedEntry>& entries) {
+        // A directory changed within the last couple of seconds could change
+        // again without its mtime moving; don't remember it yet
+        if (mtime >= scan_started - racy_window_ns) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        current_directories[dir_path] = CachedDirectory{mtime, entries};
+        dirty = true;
+    }
+    
+    bool find_file(const std::string& file_path, FileFacts& facts) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = files.find(file_path);
+        if (it == files.end()) {
+            return false;
+        }
+        facts = it->second;
+        return true;
+    }
+    
+    void store_file(const std::string& file_path, const FileFacts& facts) {
+        if (facts.mtime >= scan_started - racy_window_ns) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        files[file_path] = facts;
+        dirty = true;
+    }
+    
+private:
+    static constexpr char format_magic[] = "PPTTCACHE1\n";
+    static constexpr int64_t racy_window_ns = 2'000'000'000;
+    
+    struct CachedDirectory {
+        int64_t mtime = 0;
+        std::vector<ListedEntry> entries;
+    };
+    
+    fs::path path;
+    int64_t scan_started;
+    std::mutex mutex;
+    bool dirty = false;
+    std::unordered_map<std::string, CachedDirectory> previous_directories;
+    std::unordered_map<std::string, CachedDirectory> current_directories;
+    std::unordered_map<std::string, FileFacts> files;
+    
+    bool is_listed(const std::string& file_path) const {
+        size_t slash = file_path.rfind('/');
+        std::string dir_path = slash == std::string::npos ? "." : file_path.substr(0, slash);
+        std::string name = slash == std::string::npos ? file_path : file_path.substr(slash + 1);
+        auto it = current_directories.find(dir_path);
+        if (it == current_directories.end()) {
+            return false;
+        }
+        return std::any_of(it->second.entries.begin(), it->second.entries.end(),
+                [&](const ListedEntry& entry) { return entry.name == name; });
+    }
+    
+    template <typename T>
+    static bool read_value(std::istream& in, T& value) {
+        return static_cast<bool>(in.read(reinterpret_cast<char*>(&value), sizeof(value)));
+    }
+    
+    static bool read_string(std::istream& in, std::string& value) {
+        uint32_t length = 0;
+        if (!read_value(in, length) || length > (1u << 20)) {
+            return false;
+        }
+        value.resize(length);
+        return static_cast<bool>(in.read(value.data(), length));
+    }
+    
+    template <typename T>
+    static void write_value(std::ostream& out, const T& value) {
+        out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+    
+    static void write_string(std::ostream& out, const std::string& value) {
+        write_value(out, static_cast<uint32_t>(value.size()));
+        out.write(value.data(), static_cast<std::streamsize>(value.size()));
+    }
+};
+
+// Patterns from the .gitignore and .ignore files of one directory, chained
+// to the rules inherited from its parents. Follows gitignore(5): the last
+// matching pattern wins, deeper files override their parents, "!" negates,
+// a trailing "/" only matches directories, and patterns with a "/" in them
+// are anchored to the directory the file is in. Only files inside the
+// scanned tree are read; $GIT_DIR/info/exclude and core.excludesFile are not.
+class IgnoreRules {
+public:
+    // Rules for a directory: its own ignore files on top of what it
+    // inherits. Returns the parent rules when the directory has none.
+    // dir_prefix is the directory's key followed by "/", empty for the root.
+    static std::shared_ptr<const IgnoreRules> load(std::shared_ptr<const IgnoreRules> parent, int dir_fd,
+                                                   const std::string& dir_prefix) {
+        auto rules = std::make_shared<IgnoreRules>();
+        std::string text;
+        for (const char* name : {".gitignore", ".ignore"}) {
+            if (read_file(dir_fd, name, text)) {
+                rules->parse(text);
+            }
+        }
+        if (rules->patterns.empty()) {
+            return parent;
+        }
+        rules->parent = std::move(parent);
+        rules->base = dir_prefix;
+        return rules;
+    }
+    
+    // key is the entry's path from the base directory, name its last part
+    bool ignores(std::string_view key, std::string_view name, bool is_directory) const {
+        for (const IgnoreRules* rules = this; rules; rules = rules->parent.get()) {
+            std::string_view relative = key.substr(rules->base.size());
+            for (auto it = rules->patterns.rbegin(); it != rules->patterns.rend(); ++it) {
+                if (it->directory_only && !is_directory) {
+                    continue;
+                }
+                if (it->matches(it->anchored ? relative : name)) {
+                    return !it->negated;
+                }
+            }
+        }
+        return false;
+    }
+    
+private:
+    enum class Kind {
+        Literal, // no wildcards
+        Suffix,  // "*" followed by a literal, like "*.o"
+        Glob
+    };
+    
+    struct Pattern {
+        std::string glob;
+        Kind kind;
+        bool negated = false;
+        bool directory_only = false;
+        bool anchored = false; // matched against the path, not just the name
+        
+        bool matches(std::string_view text) const {
+            switch (kind) {
+                case Kind::Literal:
+                    return text == glob;
+                case Kind::Suffix:
+                    return text.size() >= glob.size() - 1 &&
+                           text.substr(text.size() - (glob.size() - 1)) == std::string_view(glob).substr(1);
+                case Kind::Glob:
+                    return glob_match(glob, text);
+            }
+            return false;
+        }
+    };
+    
+    std::shared_ptr<const IgnoreRules> parent;
+    std::string base;
+    std::vector<Pattern> patterns;
+    
+    static bool read_file(int dir_fd, const char* name, std::string& text) {
+        UniqueFd fd(::openat(dir_fd, name, O_RDONLY | O_CLOEXEC));
+        if (!fd) {
+            return false;
+        }
+        text.clear();
+        char chunk[16 * 1024];
+        ssize_t count;
+        while ((count = ::read(fd.get(), chunk, sizeof(chunk))) > 0) {
+            text.append(chunk, static_cast<size_t>(count));
+        }
+        return count == 0;
+    }
+    
+    void parse(std::string_view text) {
+        while (!text.empty()) {
+            size_t newline = text.find('\n');
+            std::string_view line = text.substr(0, newline);
+            text = newline == std::string_view::npos ? std::string_view() : text.substr(newline + 1);
+            
+            if (!line.empty() && line.back() == '\r') {
+                line.remove_suffix(1);
+            }
+            // Trailing spaces don't count unless escaped
+            while (!line.empty() && line.back() == ' ' && !(line.size() >= 2 && line[line.size() - 2] == '\\')) {
+                line.remove_suffix(1);
+            }
+            if (line.empty() || line[0] == '#') {
+                continue;
+            }
+            
+            Pattern pattern;
+            if (line[0] == '!') {
+                pattern.negated = true;
+                line.remove_prefix(1);
+            } else if (line.size() >= 2 && line[0] == '\\' && (line[1] == '!' || line[1] == '#')) {
+                line.remove_prefix(1);
+            }
+            if (!line.empty() && line.back() == '/') {
+                pattern.directory_only = true;
+                line.remove_suffix(1);
+            }
+            if (line.find('/') != std::string_view::npos) {
+                pattern.anchored = true;
+                if (line[0] == '/') {
+                    line.remove_prefix(1);
+                }
+            }
+            if (line.empty()) {
+                continue;
+            }
+            
+            pattern.glob = std::string(line);
+            bool wildcards_after_first = line.find_first_of("*?[\\", 1) != std::string_view::npos;
+            if (!wildcards_after_first && line[0] == '*' && !pattern.anchored) {
+                pattern.kind = Kind::Suffix;
+            } else if (!wildcards_after_first && std::string_view("*?[\\").find(line[0]) == std::string_view::npos) {
+                pattern.kind = Kind::Literal;
+            } else {
+                pattern.kind = Kind::Glob;
+            }
+            patterns.push_back(std::move(pattern));
+        }
+    }
+    
+    // Character class starting after the "[" at pattern[0]. Sets length to
+    // the size of the class including "]"; returns false if it isn't closed.
+    static bool match_class(std::string_view pattern, char c, size_t& length, bool& matched) {
+        size_t i = 0;
+        bool negate = i < pattern.size() && (pattern[i] == '!' || pattern[i] == '^');
+        if (negate) {
+            i++;
+        }
+        matched = false;
+        bool first = true;
+        for (; i < pattern.size() && (first || pattern[i] != ']'); first = false) {
+            char low = pattern[i];
+            if (low == '\\' && i + 1 < pattern.size()) {
+                low = pattern[++i];
+            }
+            char high = low;
+            if (i + 2 < pattern.size() && pattern[i + 1] == '-' && pattern[i + 2] != ']') {
+                high = pattern[i + 2];
+                i += 2;
+            }
+            if (low <= c && c <= high) {
+                matched = true;
+            }
+            i++;
+        }
+        if (i >= pattern.size()) {
+            return false;
+        }
+        matched = matched != negate;
+        length = i + 1;
+        return true;
+    }
+    
+    // Wildcard match where "*" and "?" stop at "/" and "**" crosses it.
+    // "**/" also matches no directory at all.
+    static bool glob_match(std::string_view pattern, std::string_view text) {
+        while (!pattern.empty()) {
+            char c = pattern[0];
+            if (c == '*') {
+                if (pattern.size() >= 2 && pattern[1] == '*') {
+                    pattern.remove_prefix(2);
+                    if (!pattern.empty() && pattern[0] == '/' && glob_match(pattern.substr(1), text)) {
+                        return true;
+                    }
+                    for (size_t i = 0; i <= text.size(); ++i) {
+                        if (glob_match(pattern, text.substr(i))) {
+                            return true;
+                        }
+                    }
+                    return false;
+                }
+                pattern.remove_prefix(1);
+                for (size_t i = 0; i <= text.size(); ++i) {
+                    if (glob_match(pattern, text.substr(i))) {
+                        return true;
+                    }
+                    if (i < text.size() && text[i] == '/') {
+                        break;
+                    }
+                }
+                return false;
+            }
+            if (text.empty()) {
+                return false;
+            }
+            if (c == '?') {
+                if (text[0] == '/') {
+                    return false;
+                }
+                pattern.remove_prefix(1);
+            } else if (c == '[') {
+                size_t length;
+                bool matched;
+                if (match_class(pattern.substr(1), text[0], length, matched)) {
+                    if (!matched || text[0] == '/') {
+                        return false;
+                    }
+                    pattern.remove_prefix(1 + length);
+                } else {
+                    // Unclosed: a literal "["
+                    if (text[0] != '[') {
+                        return false;
+                    }
+                    pattern.remove_prefix(1);
+                }
+            } else {
+                if (c == '\\' && pattern.size() >= 2) {
+                    pattern.remove_prefix(1);
+                    c = pattern[0];
+                }
+                if (text[0] != c) {
+                    return false;
+                }
+                pattern.remove_prefix(1);
+            }
+            text.remove_prefix(1);
+        }
+        return text.empty();
+    }
+};
+
+// In-memory result of the single directory walk, stored flat so that huge
+// trees stay small: names live in a chunked arena, nodes sit in one vector
+// and point at their parent by index. A directory's children are added in
+// one batch, so they are contiguous and in name order, and every node comes
+// after its ancestors. Only directories and matching files are stored.
+class TreeStore {
+public:
+    static constexpr uint32_t root = 0;
+    
+    enum Flag : uint8_t {
+        Directory = 1 << 0,
+        Matches = 1 << 1,               // the entry itself passes the filters
+        HasMatchingDescendant = 1 << 2, // something below it passes the filters
+        Symlink = 1 << 3,               // reached through a symlink
+        ReadError = 1 << 4              // the directory could not be read
+    };
+    
+    struct Node {
+        const char* name;
+        uint32_t parent;
+        uint32_t first_child = 0;
+        uint32_t child_count = 0;
+        uint16_t name_size;
+        uint8_t flags;
+        
+        std::string_view name_view() const { return std::string_view(name, name_size); }
+        bool has(Flag flag) const { return (flags & flag) != 0; }
+        bool visible() const { return (flags & (Matches | HasMatchingDescendant)) != 0; }
+    };
+    
+    // One entry of a directory, before it is added
+    struct NewChild {
+        std::string_view name;
+        uint8_t flags;
+    };
+    
+    TreeStore() {
+        nodes.push_back({"", 0, 0, 0, 0, Directory});
+    }
+    
+    const Node& operator[](uint32_t index) const {
+        return nodes[index];
+    }
+    
+    // Add all children of a directory and return the index of the first.
+    // Safe to call from several scan threads.
+    uint32_t add_children(uint32_t parent, const std::vector<NewChild>& children) {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint32_t first = static_cast<uint32_t>(nodes.size());
+        nodes[parent].first_child = first;
+        nodes[parent].child_count = static_cast<uint32_t>(children.size());
+        for (const auto& child : children) {
+            nodes.push_back({store_name(child.name), parent, 0, 0, static_cast<uint16_t>(child.name.size()), child.flags});
+        }
+        return first;
+    }
+    
+    // Reported when the tree is printed. An unreadable directory might
+    // contain matches, so it stays visible.
+    void set_read_error(uint32_t index, std::string message) {
+        std::lock_guard<std::mutex> lock(mutex);
+        nodes[index].flags |= ReadError | HasMatchingDescendant;
+        read_errors[index] = std::move(message);
+    }
+    
+    const std::string& read_error(uint32_t index) const {
+        return read_errors.at(index);
+    }
+    
+    // Once the scan is done: mark every directory with a visible node below
+    // it. Children come after their parents, so one backwards pass will do.
+    void propagate_matches() {
+        for (uint32_t index = static_cast<uint32_t>(nodes.size()) - 1; index > root; --index) {
+            if (nodes[index].visible()) {
+                nodes[nodes[index].parent].flags |= HasMatchingDescendant;
+            }
+        }
+    }
+    
+    // "/"-separated path from the base directory, "." for the root
+    std::string key(uint32_t index) const {
+        if (index == root) {
+            return ".";
+        }
+        std::vector<uint32_t> chain;
+        for (uint32_t current = index; current != root; current = nodes[current].parent) {
+            chain.push_back(current);
+        }
+        std::string path;
+        for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+            if (!path.empty()) {
+                path += '/';
+            }
+            path += nodes[*it].name_view();
+        }
+        return path;
+    }
+    
+    bool below_symlink(uint32_t index) const {
+        for (uint32_t current = index; current != root; current = nodes[current].parent) {
+            if (nodes[current].has(Symlink)) {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+private:
+    static constexpr size_t name_block_size = 64 * 1024;
+    
+    std::vector<Node> nodes;
+    std::vector<std::unique_ptr<char[]>> name_blocks;
+    size_t name_block_used = name_block_size;
+    std::unordered_map<uint32_t, std::string> read_errors;
+    std::mutex mutex;
+    
+    const char* store_name(std::string_view name) {
+        if (name_block_used + name.size() > name_block_size) {
+            name_blocks.push_back(std::make_unique<char[]>(std::max(name_block_size, name.size())));
+            name_block_used = 0;
+        }
+        char* stored = name_blocks.back().get() + name_block_used;
+        std::memcpy(stored, name.data(), name.size());
+        name_block_used += name.size();
+        return stored;
+    }
+};
+
+// Small work-stealing thread pool used to scan directories concurrently.
+// Every worker owns a deque: it pushes and pops its own tasks at the back
+// (depth-first, cache-friendly) and steals from the front of other workers'
+// deques when it runs dry. Tasks may submit further tasks.
+class WorkStealingPool {
+public:
+    using Task = std::function<void()>;
+    
+    explicit WorkStealingPool(unsigned thread_count)
+        : queues(std::max(1u, thread_count)) {}
+    
+    // Queue a task. From inside a running task it goes onto the calling
+    // worker's own deque, otherwise onto the first one.
+    void submit(Task task) {
+        size_t index = current_worker >= 0 ? static_cast<size_t>(current_worker) : 0;
+        pending.fetch_add(1);
+        {
+            std::lock_guard<std::mutex> lock(queues[index].mutex);
+            queues[index].tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lock(wake_mutex);
+        }
+        wake.notify_one();
+    }
+    
+    // Run until every submitted task, including the ones they submit, has
+    // finished. The calling thread works as worker 0.
+    void run() {
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < queues.size(); ++i) {
+            threads.emplace_back([this, i] { worker_loop(i); });
+        }
+        worker_loop(0);
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+    
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+    
+    std::vector<Queue> queues;
+    std::atomic<size_t> pending{0}; // queued + running tasks
+    std::mutex wake_mutex;
+    std::condition_variable wake;
+    static inline thread_local int current_worker = -1;
+    
+    bool try_pop(size_t index, Task& task) {
+        {
+            Queue& own = queues[index];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+        for (size_t offset = 1; offset < queues.size(); ++offset) {
+            Queue& victim = queues[(index + offset) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    bool has_queued_tasks() {
+        for (auto& queue : queues) {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (!queue.tasks.empty()) {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    void worker_loop(size_t index) {
+        current_worker = static_cast<int>(index);
+        Task task;
+        while (true) {
+            if (try_pop(index, task)) {
+                task();
+                task = nullptr;
+                if (pending.fetch_sub(1) == 1) {
+                    std::lock_guard<std::mutex> lock(wake_mutex);
+                    wake.notify_all();
+                }
+                continue;
+            }
+            
+            std::unique_lock<std::mutex> lock(wake_mutex);
+            if (pending.load() == 0) {
+                break;
+            }
+            if (!has_queued_tasks()) {
+                wake.wait(lock);
+            }
+        }
+        current_worker = -1;
+    }
+};
+
+// Change notifications for a set of directories, used by --watch. On
+// Linux this is inotify; elsewhere, or when a watch can't be added (e.g.
+// the inotify watch limit is reached), those directories are polled by
+// reporting them again every poll_interval.
+class DirectoryWatcher {
+public:
+    DirectoryWatcher() {
+#ifdef __linux__
+        inotify_fd = UniqueFd(::inotify_init1(IN_CLOEXEC));
+#endif
+    }
+    
+    void add(const fs::path& dir) {
+#ifdef __linux__
+        if (inotify_fd) {
+            int wd = ::inotify_add_watch(inotify_fd.get(), dir.c_str(), watch_mask);
+            if (wd >= 0) {
+                watches[wd].push_back(dir);
+                return;
+            }
+        }
+#endif
+        polled.insert(dir);
+    }
+    
+    void remove(const fs::path& dir) {
+        polled.erase(dir);
+#ifdef __linux__
+        for (auto it = watches.begin(); it != watches.end(); ++it) {
+            auto& dirs = it->second;
+            auto found = std::find(dirs.begin(), dirs.end(), dir);
+            if (found != dirs.end()) {
+                dirs.erase(found);
+                if (dirs.empty()) {
+                    ::inotify_rm_watch(inotify_fd.get(), it->first);
+                    watches.erase(it);
+                }
+                break;
+            }
+        }
+#endif
+    }
+    
+    // Block until something changes and return the directories that should
+    // be looked at again. Bursts of events are collected into one batch.
+    std::vector<fs::path> wait() {
+        std::set<fs::path> changed;
+        while (changed.empty()) {
+#ifdef __linux__
+            if (inotify_fd) {
+                int timeout = polled.empty() ? -1 : poll_interval_ms;
+                if (read_events(timeout, changed)) {
+                    // Let the burst settle before handing it out
+                    while (changed.size() < max_batch && read_events(settle_ms, changed)) {
+                    }
+                }
+            } else {
+                std::this_thread::sleep_for(std::chrono::milliseconds(poll_interval_ms));
+            }
+#else
+            std::this_thread::sleep_for(std::chrono::milliseconds(poll_interval_ms));
+#endif
+            if (changed.empty()) {
+                changed.insert(polled.begin(), polled.end());
+            }
+        }
+        return std::vector<fs::path>(changed.begin(), changed.end());
+    }
+    
+private:
+    static constexpr int poll_interval_ms = 1000;
+    static constexpr int settle_ms = 50;
+    static constexpr size_t max_batch = 4096;
+    
+    std::set<fs::path> polled;
+    
+#ifdef __linux__
+    static constexpr uint32_t watch_mask = IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE |
+                                           IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF;
+    UniqueFd inotify_fd;
+    std::map<int, std::vector<fs::path>> watches; // one watch can be reached through several paths (symlinks)
+    
+    // Wait up to timeout_ms for events and add the affected directories.
+    // Returns false on timeout.
+    bool read_events(int timeout_ms, std::set<fs::path>& changed) {
+        struct pollfd descriptor = {inotify_fd.get(), POLLIN, 0};
+        int ready = ::poll(&descriptor, 1, timeout_ms);
+        if (ready <= 0) {
+            return false;
+        }
+        
+        alignas(struct inotify_event) char buffer[64 * 1024];
+        ssize_t length = ::read(inotify_fd.get(), buffer, sizeof(buffer));
+        if (length <= 0) {
+            return false;
+        }
+        
+        for (char* cursor = buffer; cursor < buffer + length; ) {
+            auto* event = reinterpret_cast<struct inotify_event*>(cursor);
+            cursor += sizeof(struct inotify_event) + event->len;
+            
+            if (event->mask & IN_Q_OVERFLOW) {
+                // Events were lost; look at everything again
+                for (const auto& [wd, dirs] : watches) {
+                    changed.insert(dirs.begin(), dirs.end());
+                }
+                continue;
+            }
+            
+            auto it = watches.find(event->wd);
+            if (it == watches.end()) {
+                continue;
+            }
+            if (event->mask & IN_IGNORED) {
+                watches.erase(it); // the directory itself is gone
+                continue;
+            }
+            changed.insert(it->second.begin(), it->second.end());
+        }
+        return true;
+    }
+#endif
 };
 
-struct CommentStyle {
-    std::string single_line;
-    std::string multi_start;
-    std::string multi_end;
-    bool has_comments;
+// File order of the content section (--prioritize)
+enum class Priority {
+    Path,     // sorted by path
+    Smallest, // smallest files first
+    Recent    // most recently modified first
+};
+
+// Output layout (--format)
+enum class OutputFormat {
+    Text,  // tree plus comment-style banners
+    Jsonl, // one JSON object per file
+    Binary // one length-prefixed record per file
+};
+
+// Record kinds of the machine-readable formats; the binary format stores
+// the character itself
+enum class RecordKind : char {
+    File = 'F',     // part of the initial dump
+    Added = 'A',    // --watch events
+    Modified = 'M',
+    Removed = 'R',
+    Duplicate = 'D'  // --dedup: the content is the path of an earlier copy
+};
+
+// --dedup: the first file seen with each content hash. A hash match is
+// confirmed byte by byte against the content the block already holds, so
+// a collision can't hide a file; only the earlier copy is reopened.
+class DuplicateIndex {
+public:
+    // Display path of an earlier file with the same content as block, or
+    // null if there is none, in which case block becomes an original
+    const std::string* find_or_add(const FileBlock& block) {
+        auto& candidates = originals[block.content_hash];
+        std::string_view content = block.content_map ? block.content_map->view()
+                                 : block.raw_content.empty() ? std::string_view(block.body)
+                                                             : std::string_view(block.raw_content);
+        for (const auto& original : candidates) {
+            if (original.size == content.size() && same_content(original.path, content)) {
+                return &original.display_path;
+            }
+        }
+        candidates.push_back({block.source, block.display_path, block.content_size});
+        return nullptr;
+    }
+    
+private:
+    struct Original {
+        fs::path path;
+        std::string display_path;
+        uint64_t size;
+    };
+    
+    std::unordered_map<uint64_t, std::vector<Original>> originals;
+    
+    static bool same_content(const fs::path& path, std::string_view content) {
+        if (content.empty()) {
+            return true;
+        }
+        UniqueFd fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+        if (!fd) {
+            return false;
+        }
+        MappedFile mapped(fd.get(), content.size());
+        return mapped.is_mapped() && mapped.view() == content;
+    }
+};
+
+// --stats counters and timers. They are bumped from any thread, and only
+// read once the run is over, so relaxed atomics are enough. CPU times are
+// summed over threads; the others are wall time.
+struct RunStats {
+    std::atomic<uint64_t> directories_read{0};
+    std::atomic<uint64_t> entries{0};
+    std::atomic<uint64_t> entries_matched{0};
+    std::atomic<uint64_t> entries_pruned{0}; // files dropped by -e/-v, anything dropped by -g
+    std::atomic<uint64_t> regex_evaluations{0};
+    std::atomic<uint64_t> files_read{0};
+    std::atomic<uint64_t> bytes_read{0};
+    std::atomic<uint64_t> binary_skipped{0};
+    std::atomic<uint64_t> files_emitted{0};
+    std::atomic<uint64_t> scan_ns{0};
+    std::atomic<uint64_t> filter_cpu_ns{0};
+    std::atomic<uint64_t> sniff_cpu_ns{0};
+    std::atomic<uint64_t> tree_ns{0};
+    std::atomic<uint64_t> content_ns{0};
+    
+    static void add(std::atomic<uint64_t>& counter, uint64_t value) {
+        counter.fetch_add(value, std::memory_order_relaxed);
+    }
+};
+
+enum class CacheMode {
+    Auto,    // use .pptt-cache if it already exists
+    On,      // use it, creating it if needed
+    Off,     // ignore it
+    Rebuild  // don't read it, write a fresh one
 };
 
 class TreePrinter {
 private:
     std::vector<PatternFilter> pattern_filters;
+    bool has_include_filters = false;
+    std::vector<PatternFilter> content_filters; // -c/-C, excludes first
+    bool has_content_includes = false;
     bool show_dir_only = false;
     bool show_line_numbers = false;
+    unsigned jobs = 1; // directory scanning and file reading threads
+    size_t max_inflight_bytes = 64 * 1024 * 1024; // rendered but unwritten output with -j
+    mutable OutputWriter out; // all stdout output goes through here
     mutable std::set<std::string> unknown_extensions; // Track unknown extensions
+    mutable std::mutex unknown_extensions_mutex;       // -j renders files concurrently
     fs::path base_directory; // Store base directory for relative path calculations
+    CacheMode cache_mode = CacheMode::Auto;
+    mutable std::unique_ptr<ScanCache> cache; // open while a directory target is processed
+    bool watch_mode = false;
+    bool use_ignore_files = false; // -g: honour .gitignore and .ignore
+    OutputFormat output_format = OutputFormat::Text;
+    bool dedup = false; // --dedup: print repeated bodies once
+    uint64_t max_output_bytes = 0; // 0 = no limit
+    uint64_t max_output_lines = 0;
+    Priority priority = Priority::Path;
+    uint64_t target_start_bytes = 0; // the output budget applies to each target on its own
+    std::unique_ptr<RunStats> stats; // --stats, null when off
+    std::chrono::steady_clock::time_point run_start;
+    mutable std::mutex scanned_directories_mutex;
+    
+    // What --watch remembers about a visible file
+    struct WatchedFile {
+        uint64_t size;
+        int64_t mtime;
+        uint64_t inode;
+        
+        bool operator!=(const WatchedFile& other) const {
+            return size != other.size || mtime != other.mtime || inode != other.inode;
+        }
+    };
+    
+    // Visible files of every directory under the target, by relative path
+    // and name. Directories are tracked even when nothing in them matches,
+    // since a matching file could appear later.
+    using WatchedTree = std::map<std::string, std::map<std::string, WatchedFile>>;
+    
+    // One delta record: event name and relative file path
+    using WatchEvent = std::pair<std::string, std::string>;
+    
+    CommentStyles comment_styles; // shared by every target
+    
+    bool filter_matches(const PatternFilter& filter, std::string_view path_str) const {
+        switch (filter.kind) {
+            case PatternKind::Substring:
+                return path_str.find(filter.literal) != std::string_view::npos;
+            case PatternKind::Prefix:
+                return path_str.compare(0, filter.literal.size(), filter.literal) == 0;
+            case PatternKind::Suffix:
+                return path_str.size() >= filter.literal.size() &&
+                       path_str.compare(path_str.size() - filter.literal.size(), filter.literal.size(), filter.literal) == 0;
+            case PatternKind::Exact:
+                return path_str == filter.literal;
+            case PatternKind::Regex:
+                if (stats) {
+                    RunStats::add(stats->regex_evaluations, 1);
+                }
+                return std::regex_search(path_str.begin(), path_str.end(), filter.regex);
+        }
+        return false;
+    }
+    
+    // Try to reduce a regex to a literal with optional ^/$ anchors. Returns false
+    // if the pattern uses any regex feature beyond escaped punctuation.
+    static bool parse_literal_pattern(const std::string& pattern, PatternKind& kind, std::string& literal) {
+        static const std::string meta = "^$\\.*+?()[]{}|";
+        size_t begin = 0;
+        size_t end = pattern.size();
+        bool anchored_start = false;
+        bool anchored_end = false;
+        
+        if (begin < end && pattern[begin] == '^') {
+            anchored_start = true;
+            begin++;
+        }
+        if (end > begin && pattern[end - 1] == '$') {
+            // A trailing "\$" is an escaped dollar, not an anchor
+            size_t backslashes = 0;
+            for (size_t i = end - 1; i > begin && pattern[i - 1] == '\\'; --i) {
+                backslashes++;
+            }
+            if (backslashes % 2 == 0) {
+                anchored_end = true;
+                end--;
+            }
+        }
+        
+        literal.clear();
+        for (size_t i = begin; i < end; ++i) {
+            char c = pattern[i];
+            if (c == '\\') {
+                if (i + 1 >= end) {
+                    return false;
+                }
+                char next = pattern[++i];
+                // \d, \w, \b, \n, \1 ... are classes, assertions or escapes
+                if (std::isalnum(static_cast<unsigned char>(next)) || next == '_') {
+                    return false;
+                }
+                literal += next;
+            } else if (meta.find(c) != std::string::npos) {
+                return false;
+            } else {
+                literal += c;
+            }
+        }
+        
+        if (anchored_start && anchored_end) {
+            kind = PatternKind::Exact;
+        } else if (anchored_start) {
+            kind = PatternKind::Prefix;
+        } else if (anchored_end) {
+            kind = PatternKind::Suffix;
+        } else {
+            kind = PatternKind::Substring;
+        }
+        return true;
+    }
+    
+    // Path of an entry relative to the base directory, with symlinks
+    // resolved. This normalizes and stats, so the scan only falls back to it
+    // for symlinks and builds every other relative path from its parent's.
+    std::string resolve_relative(const fs::path& full_path) const {
+        return resolve_relative(full_path, base_directory);
+    }
+    
+    static std::string resolve_relative(const fs::path& full_path, const fs::path& base) {
+        fs::path relative_path;
+        try {
+            relative_path = fs::relative(full_path, base);
+        } catch (const fs::filesystem_error&) {
+            // If we can't get relative path, use the full path
+            relative_path = full_path;
+        }
+        return relative_path.generic_string();
+    }
+    
+    bool matches_patterns(const fs::path& full_path) const {
+        return pattern_filters.empty() || matches_relative_path(resolve_relative(full_path));
+    }
+    
+    bool matches_relative_path(std::string_view path_str) const {
+        if (pattern_filters.empty()) {
+            return true; // No filters means include everything
+        }
+        
+        // Filters are kept sorted: excludes first, cheapest kinds first within
+        // each group. Any exclude match rejects the path, any include match
+        // accepts it, so we can stop at the first decisive filter.
+        for (const auto& filter : pattern_filters) {
+            if (filter.is_include) {
+                break;
+            }
+            if (filter_matches(filter, path_str)) {
+                return false;
+            }
+        }
+        
+        if (!has_include_filters) {
+            return true;
+        }
+        
+        for (const auto& filter : pattern_filters) {
+            if (filter.is_include && filter_matches(filter, path_str)) {
+                return true;
+            }
+        }
+        return false;
+    } 
+
+    const CommentStyles::Style& get_comment_style(const fs::path& file_path) const {
+        std::string_view extension = extension_of(file_path.native());
+        if (const CommentStyles::Style* style = comment_styles.find(extension)) {
+            return *style;
+        }
+        
+        // Track unknown extensions (only if they have an extension)
+        if (!extension.empty() && extension != ".") {
+            std::string lower(extension);
+            std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+            std::lock_guard<std::mutex> lock(unknown_extensions_mutex);
+            unknown_extensions.insert(std::move(lower));
+        }
+        
+        // Default: no comments
+        return comment_styles.plain();
+    }
+    
+    // Whether a file body passes -c/-C. As with paths, any exclude match
+    // rejects and, if there are includes, one of them must match. Each
+    // search stops at its first hit, so a mapped file is only paged in up
+    // to where the decision is made.
+    bool content_matches(std::string_view content) const {
+        for (const auto& filter : content_filters) {
+            if (filter.is_include) {
+                break;
+            }
+            if (content_contains(filter, content)) {
+                return false;
+            }
+        }
+        if (!has_content_includes) {
+            return true;
+        }
+        for (const auto& filter : content_filters) {
+            if (filter.is_include && content_contains(filter, content)) {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    // Literals are searched in the whole body; regexes are matched line by
+    // line, so ^ and $ anchor at line boundaries like grep's (and, as with
+    // grep, an empty file has no lines to match)
+    bool content_contains(const PatternFilter& filter, std::string_view content) const {
+        if (filter.kind == PatternKind::Substring) {
+            return find_literal(content, filter.literal) != std::string_view::npos;
+        }
+        size_t start = 0;
+        while (start < content.size()) {
+            size_t end = content.find('\n', start);
+            if (end == std::string_view::npos) {
+                end = content.size();
+            }
+            if (stats) {
+                RunStats::add(stats->regex_evaluations, 1);
+            }
+            if (std::regex_search(content.begin() + start, content.begin() + end, filter.regex)) {
+                return true;
+            }
+            start = end + 1;
+        }
+        return false;
+    }
+    
+    // content_matches on a file that has been loaded into body
+    bool file_content_matches(const SourceFile& file, const std::string& body) const {
+        if (content_filters.empty()) {
+            return true;
+        }
+        if (!file.is_large()) {
+            return content_matches(body);
+        }
+        MappedFile mapped(file.descriptor(), file.size());
+        return mapped.is_mapped() && content_matches(mapped.view());
+    }
+    
+    // Binary heuristic over the first binary_sniff_size bytes: any null
+    // byte, or more than 30% non-printable characters. Empty is text.
+    static bool looks_binary(std::string_view data) {
+        size_t length = std::min(data.size(), binary_sniff_size);
+        if (length == 0) {
+            return false;
+        }
+        
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data.data());
+        if (std::memchr(bytes, '\0', length)) {
+            return true;
+        }
+        
+        // Branch-free so the compiler can vectorize the count. Common
+        // whitespace is allowed; control characters and anything above
+        // ASCII 126 count as non-printable.
+        size_t non_printable = 0;
+        for (size_t i = 0; i < length; ++i) {
+            unsigned char c = bytes[i];
+            non_printable += (c < 32) & (c != '\t') & (c != '\n') & (c != '\r');
+            non_printable += (c > 126);
+        }
+        
+        // If more than 30% non-printable, consider it binary
+        return non_printable * 100 / length > 30;
+    }
+    
+    // looks_binary on a loaded file, counted and timed for --stats
+    bool is_binary(std::string_view data, const SourceFile& file) const {
+        if (!stats) {
+            return looks_binary(data);
+        }
+        auto start = std::chrono::steady_clock::now();
+        bool binary = looks_binary(data);
+        RunStats::add(stats->sniff_cpu_ns, elapsed_ns(start));
+        RunStats::add(stats->files_read, 1);
+        if (binary) {
+            RunStats::add(stats->binary_skipped, 1);
+        } else {
+            RunStats::add(stats->bytes_read, file.size());
+        }
+        return binary;
+    }
+    
+    // Cache key of a path: relative to the base directory, "/"-separated
+    std::string relative_key(const fs::path& path) const {
+        return path.lexically_relative(base_directory).generic_string();
+    }
+    
+    static EntryType type_of(mode_t mode) {
+        return S_ISLNK(mode) ? EntryType::Symlink
+             : S_ISDIR(mode) ? EntryType::Directory
+             : S_ISREG(mode) ? EntryType::File
+             : EntryType::Other;
+    }
+    
+    // Entry type from d_type; only stat when the file system doesn't say
+    static EntryType entry_type(int dir_fd, const struct dirent* entry) {
+        switch (entry->d_type) {
+            case DT_LNK: return EntryType::Symlink;
+            case DT_DIR: return EntryType::Directory;
+            case DT_REG: return EntryType::File;
+            case DT_UNKNOWN: break;
+            default: return EntryType::Other;
+        }
+        struct stat info;
+        if (::fstatat(dir_fd, entry->d_name, &info, AT_SYMLINK_NOFOLLOW) != 0) {
+            return EntryType::Other;
+        }
+        return type_of(info.st_mode);
+    }
+    
+    // Same wording as std::filesystem's directory_iterator errors
+    static std::string directory_error(const char* what, const fs::path& dir, int error_number) {
+        return fs::filesystem_error(what, dir, std::error_code(error_number, std::generic_category())).what();
+    }
+    
+    // Sorted visible entries of a directory, from the scan cache if its
+    // mtime is unchanged, otherwise from readdir. dir_fd is left open so
+    // symlinks can be resolved relative to it. error is set if the
+    // directory exists but could not be read.
+    static bool list_directory(const fs::path& dir, const std::string& dir_key, ScanCache* cache, UniqueFd& dir_fd,
+                               std::vector<ListedEntry>& entries, std::string& error) {
+        struct stat dir_info;
+        dir_fd = UniqueFd(::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+        if (!dir_fd) {
+            // Paths that are gone or not directories are skipped quietly
+            int open_error = errno;
+            if (::stat(dir.c_str(), &dir_info) == 0 && S_ISDIR(dir_info.st_mode)) {
+                error = directory_error("directory iterator cannot open directory", dir, open_error);
+            }
+            return false;
+        }
+        if (::fstat(dir_fd.get(), &dir_info) != 0) {
+            return false;
+        }
+        
+        if (cache && cache->find_directory(dir_key, mtime_ns(dir_info), entries)) {
+            return true;
+        }
+        
+        // The stream owns its own descriptor, dir_fd stays usable
+        DIR* stream = ::fdopendir(::fcntl(dir_fd.get(), F_DUPFD_CLOEXEC, 0));
+        if (!stream) {
+            error = directory_error("directory iterator cannot open directory", dir, errno);
+            return false;
+        }
+        
+        // Collect all entries
+        int read_error = 0;
+        while (true) {
+            errno = 0;
+            const struct dirent* entry = ::readdir(stream);
+            if (!entry) {
+                read_error = errno;
+                break;
+            }
+            // Skip hidden files (starting with .), which includes . and ..
+            if (entry->d_name[0] == '.') {
+                continue;
+            }
+            entries.push_back({entry->d_name, entry_type(dir_fd.get(), entry)});
+        }
+        ::closedir(stream);
+        if (read_error != 0) {
+            error = directory_error("directory iterator cannot advance", dir, read_error);
+            return false;
+        }
+        
+        // Sort entries
+        std::sort(entries.begin(), entries.end(),
+                [](const ListedEntry& a, const ListedEntry& b) {
+                    return a.name < b.name;
+                });
+        
+        if (cache) {
+            cache->store_directory(dir_key, mtime_ns(dir_info), entries);
+        }
+        return true;
+    }
+    
+    // Follow symlinks, like directory_entry::is_directory() does
+    static EntryType resolve_type(EntryType type, int dir_fd, const std::string& name) {
+        if (type != EntryType::Symlink) {
+            return type;
+        }
+        struct stat info;
+        if (::fstatat(dir_fd, name.c_str(), &info, 0) != 0) {
+            return EntryType::Other;
+        }
+        return type_of(info.st_mode);
+    }
+    
+    // What a scan needs to know about its target. Scans don't read the
+    // current target's members, so the next target can be scanned while
+    // this one is written.
+    struct ScanRoot {
+        fs::path base;
+        ScanCache* cache;
+        std::vector<fs::path>* directories; // every directory read, for --watch
+    };
+    
+    // A directory waiting to be read. Its paths are carried down the walk
+    // so that children don't have to rebuild them from the store.
+    struct PendingDirectory {
+        uint32_t index;
+        fs::path path;
+        std::string key;      // "." for the root
+        std::string resolved; // filter path at or below a symlink, if there are filters
+        std::shared_ptr<const IgnoreRules> ignore; // with -g
+        const ScanRoot* scan;
+    };
+    
+    // Read a directory once. Matching files and all subdirectories become
+    // children in the store; subdirectories are returned for scanning.
+    void read_directory(TreeStore& store, const PendingDirectory& dir, std::vector<PendingDirectory>& subdirectories) const {
+        if (dir.scan->directories) {
+            std::lock_guard<std::mutex> lock(scanned_directories_mutex);
+            dir.scan->directories->push_back(dir.path);
+        }
+        
+        UniqueFd dir_fd;
+        std::vector<ListedEntry> entries;
+        std::string error;
+        if (!list_directory(dir.path, dir.key, dir.scan->cache, dir_fd, entries, error)) {
+            if (!error.empty()) {
+                store.set_read_error(dir.index, std::move(error));
+            }
+            return;
+        }
+        if (stats) {
+            RunStats::add(stats->directories_read, 1);
+            RunStats::add(stats->entries, entries.size());
+        }
+        
+        // Filter paths extend the parent's, in one reused buffer. Symlinks
+        // resolve elsewhere, but only need resolving if there are filters.
+        bool filtering = !pattern_filters.empty();
+        std::string key_prefix = dir.key == "." ? "" : dir.key + "/";
+        std::shared_ptr<const IgnoreRules> ignore = use_ignore_files ? IgnoreRules::load(dir.ignore, dir_fd.get(), key_prefix) : nullptr;
+        std::string entry_key = key_prefix;
+        std::string resolved_prefix = dir.resolved.empty() ? "" : dir.resolved + "/";
+        const std::string& path_prefix = dir.resolved.empty() ? key_prefix : resolved_prefix;
+        std::string relative = path_prefix;
+        
+        std::vector<TreeStore::NewChild> children;
+        std::vector<std::string> resolved_paths; // filter path of each child directory below a symlink
+        uint64_t matched = 0;
+        uint64_t pruned = 0;
+        uint64_t filter_ns = 0;
+        for (const auto& entry : entries) {
+            // Ignored entries are dropped before anything else, so ignored
+            // directories are never read
+            EntryType type = resolve_type(entry.type, dir_fd.get(), entry.name);
+            if (ignore && type != EntryType::Other) {
+                entry_key.resize(key_prefix.size());
+                entry_key += entry.name;
+                if (ignore->ignores(entry_key, entry.name, type == EntryType::Directory)) {
+                    pruned++;
+                    continue;
+                }
+            }
+            
+            TreeStore::NewChild child{entry.name, 0};
+            std::string resolved;
+            if (entry.type == EntryType::Symlink) {
+                child.flags |= TreeStore::Symlink;
+                if (filtering) {
+                    resolved = resolve_relative(dir.path / entry.name, dir.scan->base);
+                }
+            } else if (!dir.resolved.empty()) {
+                resolved = resolved_prefix + entry.name;
+            }
+            
+            bool matches = true;
+            if (filtering) {
+                if (resolved.empty()) {
+                    relative.resize(path_prefix.size());
+                    relative += entry.name;
+                }
+                if (stats) {
+                    auto start = std::chrono::steady_clock::now();
+                    matches = matches_relative_path(resolved.empty() ? relative : resolved);
+                    filter_ns += elapsed_ns(start);
+                } else {
+                    matches = matches_relative_path(resolved.empty() ? relative : resolved);
+                }
+            }
+            if (matches) {
+                child.flags |= TreeStore::Matches;
+            }
+            
+            if (type == EntryType::Directory) {
+                child.flags |= TreeStore::Directory;
+                children.push_back(child);
+                resolved_paths.push_back(std::move(resolved));
+                matched += matches;
+            } else if (type == EntryType::File && matches) {
+                children.push_back(child);
+                matched++;
+            } else if (type == EntryType::File) {
+                pruned++;
+            }
+        }
+        if (stats) {
+            RunStats::add(stats->entries_matched, matched);
+            RunStats::add(stats->entries_pruned, pruned);
+            RunStats::add(stats->filter_cpu_ns, filter_ns);
+        }
+        if (children.empty()) {
+            return;
+        }
+        
+        uint32_t first = store.add_children(dir.index, children);
+        size_t next_directory = 0;
+        for (size_t i = 0; i < children.size(); ++i) {
+            if (!(children[i].flags & TreeStore::Directory)) {
+                continue;
+            }
+            PendingDirectory subdirectory;
+            subdirectory.index = first + static_cast<uint32_t>(i);
+            subdirectory.path = dir.path / children[i].name;
+            subdirectory.key = key_prefix;
+            subdirectory.key += children[i].name;
+            subdirectory.resolved = std::move(resolved_paths[next_directory++]);
+            subdirectory.ignore = ignore;
+            subdirectory.scan = dir.scan;
+            subdirectories.push_back(std::move(subdirectory));
+        }
+    }
+    
+    void build_tree(TreeStore& store, const PendingDirectory& dir) const {
+        std::vector<PendingDirectory> subdirectories;
+        read_directory(store, dir, subdirectories);
+        for (const auto& subdirectory : subdirectories) {
+            build_tree(store, subdirectory);
+        }
+    }
+    
+    // Parallel walk: every subdirectory is a pool task. Each directory is
+    // sorted on its own, so the result doesn't depend on scheduling.
+    void build_tree(TreeStore& store, const PendingDirectory& dir, WorkStealingPool& pool) const {
+        std::vector<PendingDirectory> subdirectories;
+        read_directory(store, dir, subdirectories);
+        for (auto& subdirectory : subdirectories) {
+            pool.submit([this, &store, &pool, subdirectory = std::move(subdirectory)] {
+                build_tree(store, subdirectory, pool);
+            });
+        }
+    }
+    
+    void scan_tree(TreeStore& store, const ScanRoot& scan) const {
+        PendingDirectory root{TreeStore::root, scan.base, ".", {}, nullptr, &scan};
+        if (jobs > 1) {
+            WorkStealingPool pool(jobs);
+            pool.submit([this, &store, &root, &pool] { build_tree(store, root, pool); });
+            pool.run();
+        } else {
+            build_tree(store, root);
+        }
+        store.propagate_matches();
+    }
     
-    // Comment styles lookup table
-    std::map<std::string, CommentStyle> comment_styles = {
-        {".cpp", {"//", "/*", "*/", true}},
-        {".c", {"//", "/*", "*/", true}},
-        {".h", {"//", "/*", "*/", true}},
-        {".hpp", {"//", "/*", "*/", true}},
-        {".swift", {"//", "/*", "*/", true}},
-        {".sh", {"#", "", "", true}},
-        {".bash", {"#", "", "", true}},
-        {".py", {"#", "'''", "'''", true}},
-        {".js", {"//", "/*", "*/", true}},
-        {".ts", {"//", "/*", "*/", true}},
-        {".java", {"//", "/*", "*/", true}},
-        {".cs", {"//", "/*", "*/", true}},
-        {".go", {"//", "/*", "*/", true}},
-        {".php", {"//", "/*", "*/", true}},
-        {".rb", {"#", "=begin", "=end", true}},
-        {".rs", {"//", "/*", "*/", true}},
-        {".lua", {"--", "--[[", "]]", true}},
-        {".html", {"", "<!--", "-->", true}},
-        {".xml", {"", "<!--", "-->", true}},
-        {".yaml", {"#", "", "", true}},
-        {".yml", {"#", "", "", true}},
-        {".json", {"", "", "", false}},
-        {".ini", {"#", "", "", true}},
-        {".sql", {"--", "/*", "*/", true}},
-        {".tex", {"%", "", "", true}},
-        {".md", {"", "", "", false}},
-        {".cmake", {"#", "", "", true}},
-        {".txt", {"", "", "", false}},
-        {".proto", {"//", "/*", "*/", true}},
-        {".ex", {"#", "", "", true}},
-        {".exs", {"#", "", "", true}},
-        {".pl", {"#", "", "", true}}
-    };
+    // Absolute path of a stored node
+    fs::path node_path(const TreeStore& store, uint32_t index) const {
+        return index == TreeStore::root ? base_directory : base_directory / store.key(index);
+    }
     
-    bool matches_patterns(const fs::path& full_path) const {
-        if (pattern_filters.empty()) {
-            return true; // No filters means include everything
-        }
+    // Path shown in a file's header; below a symlink it is resolved like
+    // the filters see it
+    std::string display_path(const TreeStore& store, uint32_t index) const {
+        return store.below_symlink(index) ? resolve_relative(node_path(store, index)) : store.key(index);
+    }
     
-        // Get relative path from base directory
-        fs::path relative_path;
-        try {
-            relative_path = fs::relative(full_path, base_directory);
-        } catch (const fs::filesystem_error&) {
-            // If we can't get relative path, use the full path
-            relative_path = full_path;
+    void print_tree_line(const std::string& prefix, std::string_view name) const {
+        out.write(prefix);
+        out.write("|_ ");
+        out.write(name);
+        out.write("\n");
+    }
+    
+    // Visible files are collected in tree order, which is also path order:
+    // every directory is sorted by name and walked depth-first. With
+    // --format nothing is drawn and only the files are collected.
+    void print_tree(const TreeStore& store, uint32_t index, const std::string& prefix, std::vector<uint32_t>& visible_files,
+                    uint64_t& line_count) const {
+        const TreeStore::Node& node = store[index];
+        if (node.has(TreeStore::ReadError)) {
+            out.flush();
+            std::cerr << "Error reading directory " << node_path(store, index) << ": " << store.read_error(index) << std::endl;
+            return;
         }
         
-        // Convert to string with forward slashes (consistent across platforms)
-        std::string path_str = relative_path.string();
-        std::replace(path_str.begin(), path_str.end(), '\\', '/');
-        
-        bool has_include_filters = false;
-        bool has_exclude_filters = false;
-        bool matches_include = false;
-        bool matches_exclude = false;
-        
-        // First, determine what types of filters we have and check matches
-        for (const auto& filter : pattern_filters) {
-            try {
-                std::regex pattern_regex(filter.pattern);
-                bool matches = std::regex_search(path_str, pattern_regex);
-                
-                if (filter.is_include) {
-                    has_include_filters = true;
-                    if (matches) {
-                        matches_include = true;
-                    }
+        for (uint32_t child_index = node.first_child; child_index < node.first_child + node.child_count; ++child_index) {
+            const TreeStore::Node& child = store[child_index];
+            if (!child.visible()) {
+                continue;
+            }
+            if (child.has(TreeStore::Directory)) {
+                if (child.has(TreeStore::Matches) && output_format == OutputFormat::Text) {
+                    print_tree_line(prefix, child.name_view());
+                    line_count++;
+                    print_tree(store, child_index, prefix + "|     ", visible_files, line_count);
                 } else {
-                    has_exclude_filters = true;
-                    if (matches) {
-                        matches_exclude = true;
-                    }
+                    // Directory doesn't match, but leads to matching items
+                    print_tree(store, child_index, prefix, visible_files, line_count);
                 }
-            } catch (const std::regex_error& e) {
-                std::cerr << "Invalid regex pattern '" << filter.pattern << "': " << e.what() << std::endl;
-                return false;
+            } else {
+                if (output_format == OutputFormat::Text) {
+                    print_tree_line(prefix, child.name_view());
+                    line_count++;
+                }
+                visible_files.push_back(child_index);
+            }
+        }
+    }
+    
+    static int count_digits(size_t number) {
+        if (number == 0) return 1;
+        int digits = 0;
+        while (number > 0) {
+            number /= 10;
+            digits++;
+        }
+        return digits;
+    }
+    
+    // Number of lines as std::getline would see them: a trailing line
+    // without a newline still counts
+    static size_t count_lines(std::string_view data) {
+        size_t lines = 0;
+        const char* cursor = data.data();
+        const char* end = cursor + data.size();
+        while (cursor < end) {
+            const void* newline = std::memchr(cursor, '\n', static_cast<size_t>(end - cursor));
+            if (!newline) {
+                return lines + 1;
+            }
+            lines++;
+            cursor = static_cast<const char*>(newline) + 1;
+        }
+        return lines;
+    }
+    
+    static size_t count_newlines(std::string_view data) {
+        size_t newlines = 0;
+        const char* cursor = data.data();
+        const char* end = cursor + data.size();
+        while (const void* newline = std::memchr(cursor, '\n', static_cast<size_t>(end - cursor))) {
+            newlines++;
+            cursor = static_cast<const char*>(newline) + 1;
+        }
+        return newlines;
+    }
+    
+    // Whether a non-empty file's last byte is not a newline, i.e. whether its
+    // last line is counted by count_lines but not by count_newlines
+    static bool ends_without_newline(int fd, uint64_t size) {
+        char last;
+        return size > 0 && ::pread(fd, &last, 1, static_cast<off_t>(size - 1)) == 1 && last != '\n';
+    }
+    
+    // count_newlines on the first size bytes of a file that couldn't be
+    // mapped, read in blocks
+    static size_t count_newlines(int fd, uint64_t size) {
+        std::vector<char> buffer(1 << 16);
+        size_t newlines = 0;
+        uint64_t offset = 0;
+        while (offset < size) {
+            size_t want = static_cast<size_t>(std::min<uint64_t>(buffer.size(), size - offset));
+            ssize_t got = ::pread(fd, buffer.data(), want, static_cast<off_t>(offset));
+            if (got < 0 && errno == EINTR) {
+                continue;
             }
+            if (got <= 0) {
+                break;
+            }
+            newlines += count_newlines(std::string_view(buffer.data(), static_cast<size_t>(got)));
+            offset += static_cast<uint64_t>(got);
         }
+        return newlines;
+    }
+    
+    // Append "<n>: <line>\n" for every line, numbers right-aligned to the
+    // width of the last one
+    static void append_numbered_lines(std::string& out, std::string_view data, size_t total_lines) {
+        size_t width = static_cast<size_t>(count_digits(total_lines));
+        out.reserve(out.size() + data.size() + total_lines * (width + 3));
         
-        // Apply the logic:
-        // 1. If there are exclude filters and item matches any, exclude it
-        if (has_exclude_filters && matches_exclude) {
-            return false;
+        char number[24];
+        char* number_end = number + sizeof(number);
+        size_t line_number = 1;
+        const char* cursor = data.data();
+        const char* end = cursor + data.size();
+        while (cursor < end) {
+            const char* newline = static_cast<const char*>(std::memchr(cursor, '\n', static_cast<size_t>(end - cursor)));
+            const char* line_end = newline ? newline : end;
+            
+            char* digits = number_end;
+            size_t value = line_number;
+            do {
+                *--digits = static_cast<char>('0' + value % 10);
+                value /= 10;
+            } while (value > 0);
+            size_t digit_count = static_cast<size_t>(number_end - digits);
+            if (digit_count < width) {
+                out.append(width - digit_count, ' ');
+            }
+            out.append(digits, digit_count);
+            out.append(": ", 2);
+            out.append(cursor, static_cast<size_t>(line_end - cursor));
+            out.push_back('\n');
+            
+            cursor = newline ? newline + 1 : end;
+            line_number++;
         }
+    }
+    
+    // Fill in the body of a block whose file has already been opened and
+    // loaded: plain, numbered for -n, or left open for streaming if large.
+    // Returns the line count if it was needed (-n), otherwise -1; a known
+    // count saves counting again.
+    int64_t append_file_body(FileBlock& block, SourceFile& file, int64_t known_lines) const {
+        auto number = [&](std::string_view content) {
+            size_t lines = known_lines >= 0 ? static_cast<size_t>(known_lines) : count_lines(content);
+            append_numbered_lines(block.body, content, lines);
+            return static_cast<int64_t>(lines);
+        };
         
-        // 2. If there are include filters, item must match at least one
-        if (has_include_filters) {
-            return matches_include;
+        if (!file.is_large()) {
+            if (!show_line_numbers) {
+                return -1;
+            }
+            std::string content = std::move(block.body);
+            block.body.clear();
+            return number(content);
         }
         
-        // 3. If only exclude filters (and we got here), include it
-        return true;
-    } 
-
-    CommentStyle get_comment_style(const fs::path& file_path) const {
-        std::string extension = file_path.extension().string();
-        std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+        block.body.clear(); // only the sniffed first block
+        if (!show_line_numbers) {
+            block.body_size = file.size();
+            block.body_fd = file.release();
+            return -1;
+        }
         
-        auto it = comment_styles.find(extension);
-        if (it != comment_styles.end()) {
-            return it->second;
+        MappedFile mapped(file.descriptor(), file.size());
+        if (!mapped.is_mapped()) {
+            block.body += "Error: Could not open file\n";
+            return -1;
+        }
+        return number(mapped.view());
+    }
+    
+    static void append_header(std::string& out, const CommentStyles::Style& style, const std::string& display_path) {
+        out += style.header_open;
+        out += display_path;
+        out += style.header_close;
+    }
+    
+    static void append_footer(std::string& out, const CommentStyles::Style& style) {
+        out += style.footer;
+    }
+    
+    // Language of a file for --format records: its extension, if it is one
+    // we have a comment style for
+    std::string language_of(const fs::path& file_path) const {
+        const CommentStyles::Style* style = comment_styles.find(extension_of(file_path.native()));
+        return style ? style->extension.substr(1) : std::string();
+    }
+    
+    static void append_le(std::string& out, uint64_t value, int bytes) {
+        for (int i = 0; i < bytes; ++i) {
+            out += static_cast<char>((value >> (8 * i)) & 0xff);
+        }
+    }
+    
+    static void append_binary_string(std::string& out, std::string_view text) {
+        append_le(out, text.size(), 4);
+        out += text;
+    }
+    
+    // Length of the UTF-8 sequence at the start of text, 0 if invalid
+    static size_t utf8_sequence_length(std::string_view text) {
+        auto byte = [&](size_t i) { return static_cast<unsigned char>(text[i]); };
+        unsigned char lead = byte(0);
+        size_t length = lead >= 0xf0 && lead <= 0xf4 ? 4 : lead >= 0xe0 ? 3 : lead >= 0xc2 && lead <= 0xdf ? 2 : 0;
+        if (length == 0 || text.size() < length) {
+            return 0;
+        }
+        for (size_t i = 1; i < length; ++i) {
+            if ((byte(i) & 0xc0) != 0x80) {
+                return 0;
+            }
+        }
+        // Overlong forms, surrogates and code points past U+10FFFF
+        if ((lead == 0xe0 && byte(1) < 0xa0) || (lead == 0xed && byte(1) > 0x9f) ||
+            (lead == 0xf0 && byte(1) < 0x90) || (lead == 0xf4 && byte(1) > 0x8f)) {
+            return 0;
+        }
+        return length;
+    }
+    
+    // JSON string body: escapes what has to be and replaces invalid UTF-8
+    // with U+FFFD. Runs of plain characters are copied in one go.
+    static void append_json_chars(std::string& out, std::string_view text) {
+        static const char hex[] = "0123456789abcdef";
+        size_t run = 0;
+        size_t i = 0;
+        while (i < text.size()) {
+            unsigned char c = static_cast<unsigned char>(text[i]);
+            if (c >= 0x20 && c < 0x80 && c != '"' && c != '\\') {
+                i++;
+                continue;
+            }
+            size_t length = c >= 0x80 ? utf8_sequence_length(text.substr(i)) : 0;
+            if (length > 0) {
+                i += length;
+                continue;
+            }
+            out.append(text.data() + run, i - run);
+            switch (c) {
+                case '"': out += "\\\""; break;
+                case '\\': out += "\\\\"; break;
+                case '\n': out += "\\n"; break;
+                case '\t': out += "\\t"; break;
+                case '\r': out += "\\r"; break;
+                default:
+                    if (c < 0x20) {
+                        out += "\\u00";
+                        out += hex[c >> 4];
+                        out += hex[c & 0xf];
+                    } else {
+                        out += "\xef\xbf\xbd"; // U+FFFD
+                    }
+            }
+            run = ++i;
+        }
+        out.append(text.data() + run, text.size() - run);
+    }
+    
+    static const char* event_name(RecordKind kind) {
+        switch (kind) {
+            case RecordKind::Added: return "added";
+            case RecordKind::Modified: return "modified";
+            case RecordKind::Removed: return "removed";
+            case RecordKind::File:
+            case RecordKind::Duplicate: break;
+        }
+        return nullptr;
+    }
+    
+    // Everything of a --format record up to its content. Binary records are
+    //   "PPTT" kind:u8 path:str language:str size:u64 lines:i64 content_size:u64 content
+    // with little-endian numbers and str = length:u32 + bytes. lines is -1
+    // when unknown; records without content (-d, removed files) have
+    // content_size 0 and the JSON has no "content" field.
+    void begin_record(FileBlock& block, RecordKind kind, const std::string& path, const std::string& language,
+                      uint64_t size, int64_t lines, bool with_content, uint64_t content_size) const {
+        std::string& out = block.head;
+        if (output_format == OutputFormat::Binary) {
+            out += "PPTT";
+            out += static_cast<char>(kind);
+            append_binary_string(out, path);
+            append_binary_string(out, language);
+            append_le(out, size, 8);
+            append_le(out, static_cast<uint64_t>(lines), 8);
+            append_le(out, with_content ? content_size : 0, 8);
+            return;
         }
         
-        // Track unknown extensions (only if they have an extension)
-        if (!extension.empty() && extension != ".") {
-            unknown_extensions.insert(extension);
+        out += '{';
+        if (const char* event = event_name(kind)) {
+            out += "\"event\":\"";
+            out += event;
+            out += "\",";
+        }
+        out += "\"path\":\"";
+        append_json_chars(out, path);
+        out += "\",\"size\":" + std::to_string(size);
+        out += ",\"lines\":" + (lines >= 0 ? std::to_string(lines) : std::string("null"));
+        out += ",\"language\":";
+        if (language.empty()) {
+            out += "null";
+        } else {
+            out += '"';
+            append_json_chars(out, language);
+            out += '"';
+        }
+        if (with_content) {
+            out += ",\"content\":\"";
+            block.tail = "\"}\n";
+        } else {
+            out += "}\n";
+        }
+    }
+    
+    // A full record with the file's content. Large files go out zero-copy
+    // in the binary format; they are only mapped if the lines must be
+    // counted or the content escaped. Returns false if they can't be mapped.
+    bool render_record(FileBlock& block, SourceFile& file, const fs::path& file_path, RecordKind kind,
+                       const std::string& path, int64_t known_lines, int64_t& lines) const {
+        std::unique_ptr<MappedFile> mapped;
+        std::string_view content = block.body;
+        if (file.is_large()) {
+            content = {};
+            if (output_format == OutputFormat::Jsonl || known_lines < 0) {
+                mapped = std::make_unique<MappedFile>(file.descriptor(), file.size());
+                if (!mapped->is_mapped()) {
+                    return false;
+                }
+                content = mapped->view();
+            }
         }
+        uint64_t size = file.is_large() ? file.size() : content.size();
+        lines = known_lines >= 0 ? known_lines : static_cast<int64_t>(count_lines(content));
         
-        // Default: no comments
-        return {"", "", "", false};
+        begin_record(block, kind, path, language_of(file_path), size, lines, true, size);
+        if (output_format == OutputFormat::Jsonl) {
+            std::string escaped;
+            escaped.reserve(content.size() + content.size() / 16);
+            append_json_chars(escaped, content);
+            block.body = std::move(escaped);
+        } else if (file.is_large()) {
+            block.body.clear(); // only the sniffed first block
+            block.body_size = file.size();
+            block.body_fd = file.release();
+        }
+        return true;
     }
     
-    bool is_binary(const fs::path& file_path) const {
-        std::ifstream file(file_path, std::ios::binary);
-        if (!file.is_open()) {
-            return true; // Assume binary if can't open
+    // A record without content, for -d and removed files
+    void render_bare_record(FileBlock& block, const fs::path& file_path, RecordKind kind, const std::string& path) const {
+        struct stat info;
+        uint64_t size = kind != RecordKind::Removed && ::stat(file_path.c_str(), &info) == 0 ? static_cast<uint64_t>(info.st_size) : 0;
+        begin_record(block, kind, path, language_of(file_path), size, -1, false, 0);
+    }
+    
+    // --dedup: hash the raw content before it is numbered or escaped, and
+    // keep it until the block is checked against earlier copies. Large
+    // files are mapped for it. Returns false if they can't be.
+    bool hash_content(FileBlock& block, const SourceFile& file, const fs::path& file_path, const std::string& path) const {
+        if (file.is_large()) {
+            block.content_map = std::make_unique<MappedFile>(file.descriptor(), file.size());
+            if (!block.content_map->is_mapped()) {
+                return false;
+            }
+            block.content_hash = xxh64(block.content_map->view());
+            block.content_size = file.size();
+        } else {
+            block.content_hash = xxh64(block.body);
+            block.content_size = block.body.size();
+            if (output_format == OutputFormat::Jsonl || (output_format == OutputFormat::Text && show_line_numbers)) {
+                block.raw_content = block.body;
+            }
+        }
+        block.hashed = true;
+        block.source = file_path;
+        block.display_path = path;
+        return true;
+    }
+    
+    // Replace the content of a block by a reference to an earlier copy
+    void make_duplicate(FileBlock& block, const std::string& original) const {
+        block.body.clear();
+        block.body_fd = UniqueFd();
+        block.body_size = 0;
+        if (output_format == OutputFormat::Text) {
+            block.body = "(same content as " + original + ")\n";
+            return;
         }
         
-        // Read first 512 bytes to check for binary content
-        char buffer[512];
-        file.read(buffer, sizeof(buffer));
-        std::streamsize bytes_read = file.gcount();
+        block.head.clear();
+        block.tail.clear();
+        std::string language = language_of(block.source);
+        if (output_format == OutputFormat::Binary) {
+            begin_record(block, RecordKind::Duplicate, block.display_path, language, block.content_size, block.lines,
+                         true, original.size());
+            block.body = original;
+        } else {
+            begin_record(block, RecordKind::File, block.display_path, language, block.content_size, block.lines, false, 0);
+            block.head.resize(block.head.size() - 2); // "}\n"
+            block.head += ",\"duplicate_of\":\"";
+            append_json_chars(block.head, original);
+            block.head += "\"}\n";
+        }
+    }
+    
+    // Format one file of the content section, or its --format record.
+    // Returns false for binary files, which are skipped entirely.
+    bool render_file(FileBlock& block, const fs::path& file_path, const std::string& file_key,
+                     const std::string& display_path, const std::string& root_name, RecordKind kind) const {
+        if (output_format != OutputFormat::Text && show_dir_only) {
+            if (!content_filters.empty()) {
+                SourceFile file(file_path);
+                if (!file.is_open()) {
+                    return false;
+                }
+                file.load(block.body);
+                bool matches = file_content_matches(file, block.body);
+                block.body.clear();
+                if (!matches) {
+                    return false;
+                }
+            }
+            render_bare_record(block, file_path, kind, root_name + "/" + display_path);
+            return true;
+        }
         
-        if (bytes_read == 0) {
-            return false; // Empty file is considered text
+        FileFacts facts;
+        bool have_facts = false;
+        if (cache) {
+            have_facts = cache->find_file(file_key, facts);
+            
+            // Known binary files are skipped without opening them
+            struct stat info;
+            if (have_facts && facts.binary && ::stat(file_path.c_str(), &info) == 0 &&
+                facts.size == static_cast<uint64_t>(info.st_size) && facts.mtime == mtime_ns(info) &&
+                facts.inode == static_cast<uint64_t>(info.st_ino)) {
+                if (stats) {
+                    RunStats::add(stats->binary_skipped, 1);
+                }
+                return false;
+            }
         }
         
-        // Check for null bytes (definitive indicator of binary files)
-        for (std::streamsize i = 0; i < bytes_read; ++i) {
-            if (buffer[i] == '\0') {
-                return true;
+        // Unreadable files are treated like binary ones
+        SourceFile file(file_path);
+        if (!file.is_open()) {
+            return false;
+        }
+        file.load_start(block.body);
+        if (is_binary(block.body, file)) {
+            block.body.clear();
+            if (cache) {
+                cache->store_file(file_key, file.facts(true, -1));
             }
+            return false;
+        }
+        file.load_rest(block.body);
+        if (!file_content_matches(file, block.body)) {
+            block.body.clear();
+            return false;
         }
         
-        // Check for high ratio of non-printable characters
-        int non_printable = 0;
-        for (std::streamsize i = 0; i < bytes_read; ++i) {
-            unsigned char c = static_cast<unsigned char>(buffer[i]);
-            // Allow common whitespace characters
-            if (c < 32 && c != '\t' && c != '\n' && c != '\r') {
-                non_printable++;
+        int64_t known_lines = have_facts && file.matches(facts) ? facts.line_count : -1;
+        if (dedup && kind == RecordKind::File && !hash_content(block, file, file_path, root_name + "/" + display_path)) {
+            return false;
+        }
+        if (output_format != OutputFormat::Text) {
+            int64_t lines;
+            if (!render_record(block, file, file_path, kind, root_name + "/" + display_path, known_lines, lines)) {
+                return false;
             }
-            // Check for extended ASCII that might indicate binary
-            if (c > 126) {
-                non_printable++;
+            block.lines = lines;
+            if (cache) {
+                cache->store_file(file_key, file.facts(false, lines));
             }
+            return true;
         }
         
-        // If more than 30% non-printable, consider it binary
-        return (non_printable * 100 / bytes_read > 30);
+        const CommentStyles::Style& style = get_comment_style(file_path);
+        
+        block.head += '\n';
+        append_header(block.head, style, root_name + "/" + display_path);
+        int64_t lines = append_file_body(block, file, known_lines);
+        if (lines < 0) {
+            lines = known_lines;
+        }
+        if (cache) {
+            // A body that is in memory is counted here so that the cache
+            // knows it next time; streamed bodies are never read for it
+            if (lines < 0 && !block.body_fd) {
+                lines = static_cast<int64_t>(count_lines(block.body));
+            }
+            cache->store_file(file_key, file.facts(false, lines));
+        }
+        if (block.body_fd && lines >= 0) {
+            block.body_newlines = lines - (ends_without_newline(block.body_fd.get(), block.body_size) ? 1 : 0);
+        }
+        append_footer(block.tail, style);
+        block.tail += '\n';
+        return true;
     }
     
-    void print_tree(const fs::path& dir, const std::string& prefix, std::vector<fs::path>& visible_files) const {
-        if (!fs::exists(dir) || !fs::is_directory(dir)) {
-            return;
+    // Write a block if it fits in the budget. The block that doesn't fit
+    // is cut after the last whole line that does, marked as truncated and
+    // closed with its footer. Returns false once the budget is spent.
+    bool write_block_within_budget(const FileBlock& block, OutputBudget& budget) const {
+        if (!budget.limited()) {
+            out.write_block(block);
+            return true;
         }
         
-        std::vector<fs::directory_entry> entries;
+        // Streamed bodies are mapped only when they have to be measured or cut
+        uint64_t bytes_left = budget.bytes_left();
+        uint64_t lines_left = budget.lines_left();
+        std::unique_ptr<MappedFile> mapped;
+        std::string_view body = block.body;
+        bool count_known = block.body_newlines >= 0;
+        if (block.body_fd && ((budget.max_lines > 0 && !count_known) || block.size() > bytes_left)) {
+            mapped = std::make_unique<MappedFile>(block.body_fd.get(), block.body_size);
+            body = mapped->view();
+        }
         
-        // Collect all entries
-        try {
-            for (const auto& entry : fs::directory_iterator(dir)) {
-                // Skip hidden files (starting with .)
-                std::string filename = entry.path().filename().string();
-                if (filename[0] != '.') {
-                    entries.push_back(entry);
-                }
+        size_t head_lines = budget.max_lines > 0 ? count_newlines(block.head) : 0;
+        size_t tail_lines = budget.max_lines > 0 ? count_newlines(block.tail) : 0;
+        size_t body_lines = 0;
+        if (budget.max_lines > 0) {
+            // An unmapped body is still counted exactly, by reading it
+            if (block.body_fd && count_known) {
+                body_lines = static_cast<size_t>(block.body_newlines);
+            } else {
+                body_lines = mapped && !mapped->is_mapped() ? count_newlines(block.body_fd.get(), block.body_size)
+                                                            : count_newlines(body);
             }
-        } catch (const fs::filesystem_error& e) {
-            std::cerr << "Error reading directory " << dir << ": " << e.what() << std::endl;
-            return;
+        }
+        if (block.size() <= bytes_left && head_lines + body_lines + tail_lines <= lines_left) {
+            out.write_block(block);
+            budget.bytes += block.size();
+            budget.lines += head_lines + body_lines + tail_lines;
+            return true;
         }
         
-        // Sort entries
-        std::sort(entries.begin(), entries.end(), 
-                [](const fs::directory_entry& a, const fs::directory_entry& b) {
-                    return a.path().filename() < b.path().filename();
-                });
+        // --format records are never cut
+        budget.exhausted = true;
+        if (block.body_fd && !mapped && output_format == OutputFormat::Text) {
+            mapped = std::make_unique<MappedFile>(block.body_fd.get(), block.body_size); // skipped for a known count
+            body = mapped->view();
+        }
+        static const std::string_view marker = "... (truncated: output budget reached)\n";
+        uint64_t fixed_bytes = block.head.size() + marker.size() + block.tail.size();
+        uint64_t fixed_lines = head_lines + 1 + tail_lines;
+        if (output_format != OutputFormat::Text || (block.body_fd && !mapped->is_mapped()) ||
+            fixed_bytes > bytes_left || fixed_lines > lines_left) {
+            return false;
+        }
         
-        // Print entries and collect visible files
-        for (const auto& entry : entries) {
-            std::string filename = entry.path().filename().string();
-            
-            if (entry.is_directory()) {
-                // Check if directory matches patterns
-                if (matches_patterns(entry.path())) {
-                    std::cout << prefix << "|_ " << filename << std::endl;
-                    print_tree(entry.path(), prefix + "|     ", visible_files);
-                } else {
-                    // Directory doesn't match patterns, but explore if it might contain matching items
-                    if (directory_contains_matches(entry.path())) {
-                        print_tree(entry.path(), prefix, visible_files);
+        uint64_t body_bytes_left = bytes_left - fixed_bytes;
+        uint64_t body_lines_left = lines_left - fixed_lines;
+        size_t cut = 0;
+        size_t kept_lines = 0;
+        while (kept_lines < body_lines_left) {
+            const void* newline = std::memchr(body.data() + cut, '\n', body.size() - cut);
+            if (!newline) {
+                break;
+            }
+            size_t end = static_cast<size_t>(static_cast<const char*>(newline) - body.data()) + 1;
+            if (end > body_bytes_left) {
+                break;
+            }
+            cut = end;
+            kept_lines++;
+        }
+        
+        out.write(block.head);
+        out.write(body.substr(0, cut));
+        out.write(marker);
+        out.write(block.tail);
+        budget.bytes += fixed_bytes + cut;
+        budget.lines += fixed_lines + kept_lines;
+        budget.cut_short = true;
+        return false;
+    }
+    
+    // Blocks are checked against earlier ones in output order, so the
+    // first copy in path order is the one printed in full
+    bool write_unique_block(FileBlock& block, OutputBudget& budget, DuplicateIndex& duplicates) const {
+        if (stats) {
+            RunStats::add(stats->files_emitted, 1);
+        }
+        if (block.hashed) {
+            if (const std::string* original = duplicates.find_or_add(block)) {
+                make_duplicate(block, *original);
+            }
+            block.content_map.reset();
+            block.raw_content = std::string();
+        }
+        return write_block_within_budget(block, budget);
+    }
+    
+    OutputBudget start_budget(uint64_t lines_so_far) const {
+        OutputBudget budget;
+        budget.max_bytes = max_output_bytes;
+        budget.max_lines = max_output_lines;
+        budget.bytes = out.bytes_written() - target_start_bytes;
+        budget.lines = lines_so_far;
+        return budget;
+    }
+    
+    // Pipelined output for -j: reader threads render upcoming files in
+    // parallel while this thread writes finished blocks in sorted order.
+    // Readers stop claiming new files once max_inflight_bytes are rendered
+    // but not yet written; the file the writer is waiting for is always
+    // allowed through so the pipeline can't stall. Blocks live in a ring of
+    // a few slots per reader, reused as the writer moves on, so memory does
+    // not grow with the number of files.
+    // Returns how many files were taken care of before the budget ran out.
+    size_t emit_files_parallel(const TreeStore& store, const std::vector<uint32_t>& files, const std::string& root_name,
+                               OutputBudget& budget, DuplicateIndex& duplicates) const {
+        struct Slot {
+            FileBlock block;
+            bool rendered = false; // false for binary or unreadable files
+            bool ready = false;
+        };
+        
+        const size_t ring_size = std::min<size_t>(files.size(), std::max<size_t>(jobs, 1) * 4);
+        std::vector<Slot> slots(ring_size);
+        std::mutex mutex;
+        std::condition_variable changed;
+        size_t next_to_claim = 0;
+        size_t next_to_write = 0;
+        size_t inflight_bytes = 0;
+        bool stopping = false; // budget spent, don't read anything else
+        
+        auto reader = [&] {
+            while (true) {
+                size_t index;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    if (stopping || next_to_claim >= files.size()) {
+                        return;
+                    }
+                    index = next_to_claim++;
+                    changed.wait(lock, [&] {
+                        return stopping || (index < next_to_write + ring_size &&
+                                            (inflight_bytes < max_inflight_bytes || index == next_to_write));
+                    });
+                    if (stopping) {
+                        return;
                     }
                 }
-            } else if (entry.is_regular_file()) {
-                // Check if file matches patterns
-                if (matches_patterns(entry.path())) {
-                    std::cout << prefix << "|_ " << filename << std::endl;
-                    visible_files.push_back(entry.path());
+                
+                FileBlock block;
+                uint32_t file = files[index];
+                bool rendered = render_file(block, node_path(store, file), store.key(file), display_path(store, file),
+                                            root_name, RecordKind::File);
+                
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    inflight_bytes += block.size();
+                    Slot& slot = slots[index % ring_size];
+                    slot.block = std::move(block);
+                    slot.rendered = rendered;
+                    slot.ready = true;
                 }
+                changed.notify_all();
+            }
+        };
+        
+        std::vector<std::thread> readers;
+        size_t reader_count = std::min<size_t>(jobs, files.size());
+        for (size_t i = 0; i < reader_count; ++i) {
+            readers.emplace_back(reader);
+        }
+        
+        size_t index = 0;
+        while (index < files.size()) {
+            FileBlock block;
+            bool rendered;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                Slot& slot = slots[index % ring_size];
+                changed.wait(lock, [&] { return slot.ready; });
+                block = std::move(slot.block);
+                rendered = slot.rendered;
+                slot.block = FileBlock();
+                slot.ready = false;
+                inflight_bytes -= block.size();
+                next_to_write = index + 1;
+            }
+            changed.notify_all();
+            index++;
+            if (rendered && !write_unique_block(block, budget, duplicates)) {
+                break;
             }
         }
+        
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        changed.notify_all();
+        for (auto& thread : readers) {
+            thread.join();
+        }
+        return index;
     }
     
-    int count_digits(int number) const {
-        if (number == 0) return 1;
-        int digits = 0;
-        while (number > 0) {
-            number /= 10;
-            digits++;
+    // Reorder files for --prioritize; ties keep path order
+    void prioritize_files(const TreeStore& store, std::vector<uint32_t>& files) const {
+        if (priority == Priority::Path) {
+            return;
+        }
+        
+        std::vector<std::pair<int64_t, uint32_t>> keyed;
+        keyed.reserve(files.size());
+        for (uint32_t file : files) {
+            struct stat info;
+            int64_t key = INT64_MAX;
+            if (::stat(node_path(store, file).c_str(), &info) == 0) {
+                key = priority == Priority::Smallest ? static_cast<int64_t>(info.st_size) : -mtime_ns(info);
+            }
+            keyed.emplace_back(key, file);
+        }
+        std::stable_sort(keyed.begin(), keyed.end(),
+                [](const auto& a, const auto& b) { return a.first < b.first; });
+        for (size_t i = 0; i < files.size(); ++i) {
+            files[i] = keyed[i].second;
         }
-        return digits;
     }
     
-    void print_file_content_with_lines(const fs::path& file_path) const {
-        std::ifstream file(file_path);
-        if (!file.is_open()) {
-            std::cout << "Error: Could not open file" << std::endl;
+    void print_file_content(const TreeStore& store, std::vector<uint32_t>& files, const std::string& root_name,
+                            uint64_t lines_so_far) const {
+        if (files.empty()) {
+            print_message("\nNo matching directories or files!\n");
             return;
         }
         
-        if (!show_line_numbers) {
-            std::cout << file.rdbuf();
-            return;
+        // files come in path order from print_tree; --prioritize reorders them
+        prioritize_files(store, files);
+        
+        OutputBudget budget = start_budget(lines_so_far);
+        DuplicateIndex duplicates;
+        size_t handled = 0;
+        if (jobs > 1) {
+            handled = emit_files_parallel(store, files, root_name, budget, duplicates);
+        } else {
+            // Print file contents, stopping as soon as the budget is spent
+            while (handled < files.size()) {
+                FileBlock block;
+                uint32_t file = files[handled];
+                bool rendered = render_file(block, node_path(store, file), store.key(file), display_path(store, file), root_name, RecordKind::File);
+                handled++;
+                if (rendered && !write_unique_block(block, budget, duplicates)) {
+                    break;
+                }
+            }
         }
         
-        // First pass: count total lines to determine width
-        std::string line;
-        int total_lines = 0;
-        std::streampos start_pos = file.tellg();
+        if (budget.exhausted) {
+            size_t not_shown = files.size() - handled + (budget.cut_short ? 0 : 1);
+            out.flush();
+            std::cerr << "Warning: output budget reached; " << not_shown << " more file(s) not shown." << std::endl;
+        }
+    }
+    
+    // process_target has already checked that this is a regular file
+    void print_single_file(const fs::path& file_path) const {
+        fs::path parent_dir = file_path.parent_path();
+        std::string root_name = parent_dir.filename().string();
+        std::string file_name = file_path.filename().string();
         
-        while (std::getline(file, line)) {
-            total_lines++;
+        FileBlock block;
+        if (output_format != OutputFormat::Text && show_dir_only) {
+            render_bare_record(block, file_path, RecordKind::File, root_name + "/" + file_name);
+            out.write_block(block);
+            return;
         }
         
-        // Reset file position
-        file.clear();
-        file.seekg(start_pos);
+        SourceFile file(file_path);
+        if (file.is_open()) {
+            file.load_start(block.body);
+        }
+        if (!file.is_open() || is_binary(block.body, file)) {
+            std::ostringstream message;
+            message << "The file " << file_path << " is binary. Content not displayed." << std::endl;
+            print_message(message.str());
+            return;
+        }
+        file.load_rest(block.body);
+        if (!file_content_matches(file, block.body)) {
+            print_message("No matching directories or files!\n");
+            return;
+        }
         
-        // Determine width for line numbers
-        int width = count_digits(total_lines);
+        if (output_format != OutputFormat::Text) {
+            int64_t lines;
+            if (render_record(block, file, file_path, RecordKind::File, root_name + "/" + file_name, -1, lines)) {
+                out.write_block(block);
+            }
+            return;
+        }
         
-        // Second pass: print with line numbers
-        int line_number = 1;
-        while (std::getline(file, line)) {
-            std::cout << std::setw(width) << line_number << ": " << line << std::endl;
-            line_number++;
+        const CommentStyles::Style& style = get_comment_style(file_path);
+        append_header(block.head, style, root_name + "/" + file_name);
+        append_file_body(block, file, -1);
+        append_footer(block.tail, style);
+        OutputBudget budget = start_budget(0);
+        if (!write_block_within_budget(block, budget) && !budget.cut_short) {
+            out.flush();
+            std::cerr << "Warning: output budget too small to show " << file_name << std::endl;
+        }
+    }
+    
+    static std::string child_key(const std::string& dir_key, const std::string& name) {
+        return dir_key == "." ? name : dir_key + "/" + name;
+    }
+    
+    fs::path key_path(const std::string& key) const {
+        return key == "." ? base_directory : base_directory / key;
+    }
+    
+    static bool stat_watched_file(const fs::path& path, WatchedFile& file) {
+        struct stat info;
+        if (::stat(path.c_str(), &info) != 0) {
+            return false;
+        }
+        file = {static_cast<uint64_t>(info.st_size), mtime_ns(info), static_cast<uint64_t>(info.st_ino)};
+        return true;
+    }
+    
+    // Ignore rules that apply inside a directory, loaded from the base
+    // directory down. The scan passes them along instead; this is for the
+    // few directories --watch revisits.
+    std::shared_ptr<const IgnoreRules> ignore_rules_for(const std::string& dir_key) const {
+        if (!use_ignore_files) {
+            return nullptr;
+        }
+        std::shared_ptr<const IgnoreRules> rules;
+        std::string key = ".";
+        size_t next = 0;
+        while (true) {
+            UniqueFd dir_fd(::open(key_path(key).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+            if (dir_fd) {
+                rules = IgnoreRules::load(rules, dir_fd.get(), key == "." ? "" : key + "/");
+            }
+            if (key == dir_key) {
+                return rules;
+            }
+            size_t slash = dir_key.find('/', next);
+            key = dir_key.substr(0, slash);
+            next = slash == std::string::npos ? dir_key.size() : slash + 1;
         }
     }
     
-    void print_file_content(const std::vector<fs::path>& visible_files, const std::string& root_name, const fs::path& base_dir) const {
-        if (visible_files.empty()) {
-            std::cout << std::endl << "No matching directories or files!" << std::endl;
+    // Start tracking a directory that appeared after the initial scan;
+    // everything visible in it is new
+    void watch_new_directory(const std::string& dir_key, WatchedTree& tree, DirectoryWatcher& watcher,
+                             std::vector<WatchEvent>& events) const {
+        fs::path dir = key_path(dir_key);
+        watcher.add(dir);
+        auto& files = tree[dir_key];
+        
+        UniqueFd dir_fd;
+        std::vector<ListedEntry> entries;
+        std::string error;
+        if (!list_directory(dir, dir_key, cache.get(), dir_fd, entries, error)) {
             return;
         }
-        
-        // Sort files
-        std::vector<fs::path> sorted_files = visible_files;
-        std::sort(sorted_files.begin(), sorted_files.end());
-        
-        // Print file contents
-        for (const auto& file_path : sorted_files) {
-            if (is_binary(file_path)) {
-                // Skip binary files, don't show content
+        auto ignore = ignore_rules_for(dir_key);
+        for (const auto& entry : entries) {
+            std::string key = child_key(dir_key, entry.name);
+            fs::path path = dir / entry.name;
+            EntryType type = resolve_type(entry.type, dir_fd.get(), entry.name);
+            if (ignore && ignore->ignores(key, entry.name, type == EntryType::Directory)) {
                 continue;
             }
-            
-            fs::path relative_path = fs::relative(file_path, base_dir);
-            CommentStyle style = get_comment_style(file_path);
-            
-            std::cout << std::endl;
-            
-            if (style.has_comments && !style.single_line.empty()) {
-                // Use single-line comments
-                std::cout << style.single_line << " ========================================================" << std::endl;
-                std::cout << style.single_line << "  File: " << root_name << "/" << relative_path.string() << std::endl;
-                std::cout << style.single_line << "  <content> ----------------------------------------------" << std::endl;
-            } else {
-                // Fallback to original format for files without comments
-                std::cout << "===================================" << std::endl;
-                std::cout << "File: " << root_name << "/" << relative_path.string() << std::endl;
-                std::cout << "<content> -------------------------" << std::endl;
+            WatchedFile file;
+            if (type == EntryType::Directory) {
+                if (!tree.count(key)) {
+                    watch_new_directory(key, tree, watcher, events);
+                }
+            } else if (type == EntryType::File && matches_patterns(path) && stat_watched_file(path, file)) {
+                files[entry.name] = file;
+                events.emplace_back("added", key);
             }
-            
-            print_file_content_with_lines(file_path);
-            
-            if (style.has_comments && !style.single_line.empty()) {
-                std::cout << style.single_line << "  </content> ----------------------------------------------" << std::endl;
+        }
+    }
+    
+    // Stop tracking a directory and everything below it
+    void forget_directory(const std::string& dir_key, WatchedTree& tree, DirectoryWatcher& watcher,
+                          std::vector<WatchEvent>& events) const {
+        std::string prefix = dir_key + "/";
+        for (auto it = tree.begin(); it != tree.end(); ) {
+            if (it->first == dir_key || it->first.compare(0, prefix.size(), prefix) == 0) {
+                for (const auto& [name, file] : it->second) {
+                    events.emplace_back("removed", child_key(it->first, name));
+                }
+                watcher.remove(key_path(it->first));
+                it = tree.erase(it);
             } else {
-                std::cout << "</content> ------------------------" << std::endl;
+                ++it;
             }
-            std::cout << std::endl;
         }
     }
-
-    // Helper method to check if a directory contains any matching files/subdirectories
-    bool directory_contains_matches(const fs::path& dir) const {
-        if (!fs::exists(dir) || !fs::is_directory(dir)) {
-            return false;
+    
+    // Compare a directory with what we remember about it
+    void rescan_watched_directory(const std::string& dir_key, WatchedTree& tree, DirectoryWatcher& watcher,
+                                  std::vector<WatchEvent>& events) const {
+        fs::path dir = key_path(dir_key);
+        UniqueFd dir_fd;
+        std::vector<ListedEntry> entries;
+        std::string error;
+        if (!list_directory(dir, dir_key, cache.get(), dir_fd, entries, error)) {
+            if (dir_key != ".") {
+                forget_directory(dir_key, tree, watcher, events);
+            }
+            return;
         }
         
-        try {
-            for (const auto& entry : fs::directory_iterator(dir)) {
-                std::string filename = entry.path().filename().string();
-                
-                // Skip hidden files
-                if (filename[0] == '.') {
-                    continue;
-                }
-                
-                // Check if this item matches the patterns
-                if (matches_patterns(entry.path())) {
-                    return true;
+        auto& files = tree[dir_key];
+        auto ignore = ignore_rules_for(dir_key);
+        std::set<std::string> seen_files;
+        std::set<std::string> seen_directories;
+        for (const auto& entry : entries) {
+            std::string key = child_key(dir_key, entry.name);
+            fs::path path = dir / entry.name;
+            EntryType type = resolve_type(entry.type, dir_fd.get(), entry.name);
+            if (ignore && ignore->ignores(key, entry.name, type == EntryType::Directory)) {
+                continue;
+            }
+            WatchedFile file;
+            if (type == EntryType::Directory) {
+                seen_directories.insert(key);
+                if (!tree.count(key)) {
+                    watch_new_directory(key, tree, watcher, events);
                 }
-                
-                // If it's a directory, recursively check its contents
-                if (entry.is_directory()) {
-                    if (directory_contains_matches(entry.path())) {
-                        return true;
-                    }
+            } else if (type == EntryType::File && matches_patterns(path) && stat_watched_file(path, file)) {
+                seen_files.insert(entry.name);
+                auto known = files.find(entry.name);
+                if (known == files.end()) {
+                    events.emplace_back("added", key);
+                } else if (known->second != file) {
+                    events.emplace_back("modified", key);
                 }
+                files[entry.name] = file;
             }
-        } catch (const fs::filesystem_error& e) {
-            // If we can't read the directory, assume it might contain matches
-            return true;
         }
         
-        return false;
+        for (auto it = files.begin(); it != files.end(); ) {
+            if (!seen_files.count(it->first)) {
+                events.emplace_back("removed", child_key(dir_key, it->first));
+                it = files.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        
+        // Subdirectories that are gone
+        std::string prefix = dir_key == "." ? "" : dir_key + "/";
+        std::vector<std::string> vanished;
+        for (auto it = tree.lower_bound(prefix); it != tree.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+            const std::string& key = it->first;
+            if (key != "." && key != dir_key && key.find('/', prefix.size()) == std::string::npos &&
+                !seen_directories.count(key)) {
+                vanished.push_back(key);
+            }
+        }
+        for (const auto& key : vanished) {
+            forget_directory(key, tree, watcher, events);
+        }
     }
     
-    void print_single_file(const fs::path& file_path) const {
-        if (!fs::exists(file_path) || !fs::is_regular_file(file_path)) {
-            std::cout << "Error: File does not exist or is not a regular file." << std::endl;
+    void print_watch_event(const WatchEvent& event, const std::string& root_name) const {
+        fs::path path = key_path(event.second);
+        if (output_format != OutputFormat::Text) {
+            RecordKind kind = event.first == "added" ? RecordKind::Added
+                            : event.first == "modified" ? RecordKind::Modified
+                            : RecordKind::Removed;
+            FileBlock block;
+            if (kind == RecordKind::Removed) {
+                render_bare_record(block, path, kind, root_name + "/" + event.second);
+                out.write_block(block);
+            } else if (render_file(block, path, event.second, resolve_relative(path), root_name, kind)) {
+                out.write_block(block);
+            }
             return;
         }
         
-        if (is_binary(file_path)) {
-            std::cout << "The file " << file_path << " is binary. Content not displayed." << std::endl;
-            return;
+        out.write("\n@@ " + event.first + ": " + root_name + "/" + event.second + "\n");
+        if (event.first != "removed" && !show_dir_only) {
+            FileBlock block;
+            if (render_file(block, path, event.second, resolve_relative(path), root_name, RecordKind::File)) {
+                out.write_block(block);
+            }
         }
-        
-        fs::path parent_dir = file_path.parent_path();
-        std::string root_name = parent_dir.filename().string();
-        std::string file_name = file_path.filename().string();
-        CommentStyle style = get_comment_style(file_path);
-        
-        if (style.has_comments && !style.single_line.empty()) {
-            // Use single-line comments
-            std::cout << style.single_line << " ========================================================" << std::endl;
-            std::cout << style.single_line << "  File: " << root_name << "/" << file_name << std::endl;
-            std::cout << style.single_line << "  <content> ----------------------------------------------" << std::endl;
-        } else {
-            // Fallback to original format
-            std::cout << "===================================" << std::endl;
-            std::cout << "File: " << root_name << "/" << file_name << std::endl;
-            std::cout << "<content> -------------------------" << std::endl;
+    }
+    
+    // --watch: after the initial dump, keep the tree in memory and print a
+    // delta record for every visible file that is added, modified or
+    // removed. Runs until the process is interrupted.
+    [[noreturn]] void watch_tree(const std::string& root_name, const std::vector<fs::path>& directories,
+                                 const TreeStore& store, const std::vector<uint32_t>& visible_files) const {
+        DirectoryWatcher watcher;
+        WatchedTree tree;
+        for (const auto& dir : directories) {
+            tree[relative_key(dir)];
+            watcher.add(dir);
         }
+        for (uint32_t index : visible_files) {
+            WatchedFile file;
+            if (stat_watched_file(node_path(store, index), file)) {
+                std::string key = store.key(index);
+                size_t slash = key.rfind('/');
+                std::string dir_key = slash == std::string::npos ? "." : key.substr(0, slash);
+                tree[dir_key][std::string(store[index].name_view())] = file;
+            }
+        }
+        out.flush();
         
-        print_file_content_with_lines(file_path);
-        
-        if (style.has_comments && !style.single_line.empty()) {
-            std::cout << style.single_line << "  </content> ----------------------------------------------" << std::endl;
+        while (true) {
+            std::vector<WatchEvent> events;
+            for (const auto& dir : watcher.wait()) {
+                std::string dir_key = relative_key(dir);
+                if (tree.count(dir_key)) {
+                    rescan_watched_directory(dir_key, tree, watcher, events);
+                }
+            }
+            
+            std::sort(events.begin(), events.end(), [](const WatchEvent& a, const WatchEvent& b) {
+                return a.second < b.second;
+            });
+            for (const auto& event : events) {
+                print_watch_event(event, root_name);
+            }
+            out.flush();
+        }
+    }
+    
+    // Status messages are part of the text output; with --format they go
+    // to stderr so stdout only carries records
+    void print_message(const std::string& message) const {
+        if (output_format == OutputFormat::Text) {
+            out.write(message);
         } else {
-            std::cout << "</content> ------------------------" << std::endl;
+            out.flush();
+            std::cerr << message;
+        }
+    }
+    
+    void print_stats() {
+        if (!stats) {
+            return;
         }
+        out.flush();
+        auto ms = [](uint64_t ns) {
+            std::ostringstream text;
+            text.setf(std::ios::fixed);
+            text.precision(3);
+            text << ns / 1e6 << " ms";
+            return text.str();
+        };
+        auto load = [](const std::atomic<uint64_t>& counter) {
+            return counter.load(std::memory_order_relaxed);
+        };
+        std::cerr << std::endl << "Stats:" << std::endl;
+        std::cerr << "  directories read:      " << load(stats->directories_read) << std::endl;
+        std::cerr << "  entries:               " << load(stats->entries) << " (" << load(stats->entries_matched)
+                  << " matched, " << load(stats->entries_pruned) << " pruned)" << std::endl;
+        std::cerr << "  regex evaluations:     " << load(stats->regex_evaluations) << std::endl;
+        std::cerr << "  files read:            " << load(stats->files_read) << " (" << load(stats->bytes_read)
+                  << " bytes of text)" << std::endl;
+        std::cerr << "  binary files skipped:  " << load(stats->binary_skipped) << std::endl;
+        std::cerr << "  files emitted:         " << load(stats->files_emitted) << std::endl;
+        std::cerr << "  bytes written:         " << out.bytes_written() << " (" << out.device_bytes()
+                  << " to stdout)" << std::endl;
+        std::cerr << "  scan:                  " << ms(load(stats->scan_ns)) << std::endl;
+        std::cerr << "    filtering (cpu):     " << ms(load(stats->filter_cpu_ns)) << std::endl;
+        std::cerr << "  binary sniff (cpu):    " << ms(load(stats->sniff_cpu_ns)) << std::endl;
+        std::cerr << "  tree:                  " << ms(load(stats->tree_ns)) << std::endl;
+        std::cerr << "  content:               " << ms(load(stats->content_ns)) << std::endl;
+        std::cerr << "    stdout writes:       " << ms(out.write_time_ns()) << std::endl;
+        std::cerr << "  total:                 " << ms(elapsed_ns(run_start)) << std::endl;
     }
     
     void print_unknown_extensions_warning() const {
+        out.flush();
         if (!unknown_extensions.empty()) {
             std::cerr << std::endl << "Warning: Unknown file extensions encountered (no comment style defined):" << std::endl;
             for (const auto& ext : unknown_extensions) {
@@ -417,8 +3566,58 @@ private:
     }
     
 public:
-    void add_pattern_filter(const std::string& pattern, bool is_include) {
-        pattern_filters.push_back({pattern, is_include});
+    bool add_pattern_filter(const std::string& pattern, bool is_include) {
+        PatternFilter filter{pattern, is_include, PatternKind::Regex, "", std::regex()};
+        
+        if (!parse_literal_pattern(pattern, filter.kind, filter.literal)) {
+            filter.kind = PatternKind::Regex;
+            try {
+                filter.regex = std::regex(pattern, std::regex::ECMAScript | std::regex::optimize);
+            } catch (const std::regex_error& e) {
+                std::cerr << "Invalid regex pattern '" << pattern << "': " << e.what() << std::endl;
+                return false;
+            }
+        }
+        
+        pattern_filters.push_back(std::move(filter));
+        if (is_include) {
+            has_include_filters = true;
+        }
+        
+        // Keep excludes first and regexes last within each group
+        std::stable_sort(pattern_filters.begin(), pattern_filters.end(),
+                [](const PatternFilter& a, const PatternFilter& b) {
+                    if (a.is_include != b.is_include) {
+                        return !a.is_include;
+                    }
+                    return (a.kind == PatternKind::Regex) < (b.kind == PatternKind::Regex);
+                });
+        return true;
+    }
+    
+    // -c/-C. Plain literals use find_literal; anything else, including
+    // anchored literals, is a regex applied to each line.
+    bool add_content_filter(const std::string& pattern, bool is_include) {
+        PatternFilter filter{pattern, is_include, PatternKind::Regex, "", std::regex()};
+        if (!parse_literal_pattern(pattern, filter.kind, filter.literal) || filter.kind != PatternKind::Substring) {
+            filter.kind = PatternKind::Regex;
+            try {
+                filter.regex = std::regex(pattern, std::regex::ECMAScript | std::regex::optimize);
+            } catch (const std::regex_error& e) {
+                std::cerr << "Invalid regex pattern '" << pattern << "': " << e.what() << std::endl;
+                return false;
+            }
+        }
+        
+        content_filters.push_back(std::move(filter));
+        if (is_include) {
+            has_content_includes = true;
+        }
+        std::stable_sort(content_filters.begin(), content_filters.end(),
+                [](const PatternFilter& a, const PatternFilter& b) {
+                    return !a.is_include && b.is_include;
+                });
+        return true;
     }
     
     void set_show_dir_only(bool value) {
@@ -429,82 +3628,278 @@ public:
         show_line_numbers = value;
     }
     
-    void process_target(const std::string& target) {
-        if (target.empty()) {
-            // Current directory
-            base_directory = fs::current_path();
-            std::string root_name = base_directory.filename().string();
-            
-            std::cout << root_name << std::endl;
-            
-            std::vector<fs::path> visible_files;
-            print_tree(base_directory, "", visible_files);
-            
-            if (!show_dir_only) {
-                print_file_content(visible_files, root_name, base_directory);
+    void set_jobs(unsigned value) {
+        jobs = value;
+    }
+    
+    void set_max_inflight_bytes(size_t value) {
+        max_inflight_bytes = value;
+    }
+    
+    void set_cache_mode(CacheMode value) {
+        cache_mode = value;
+    }
+    
+    void set_watch_mode(bool value) {
+        watch_mode = value;
+    }
+    
+    void set_use_ignore_files(bool value) {
+        use_ignore_files = value;
+    }
+    
+    void set_output_format(OutputFormat value) {
+        output_format = value;
+    }
+    
+    void set_stats(bool value) {
+        stats = value ? std::make_unique<RunStats>() : nullptr;
+        out.set_timing(value);
+    }
+    
+    bool load_comment_styles(const fs::path& path, std::string& error) {
+        return comment_styles.load(path, error);
+    }
+    
+    void set_dedup(bool value) {
+        dedup = value;
+    }
+    
+    bool enable_compression(int level, int workers, std::string& error) {
+        return out.enable_zstd(level, workers, error);
+    }
+    
+    void set_output_budget(uint64_t max_bytes, uint64_t max_lines) {
+        max_output_bytes = max_bytes;
+        max_output_lines = max_lines;
+    }
+    
+    void set_priority(Priority value) {
+        priority = value;
+    }
+    
+    std::unique_ptr<ScanCache> open_cache(const fs::path& dir) const {
+        if (cache_mode == CacheMode::Off) {
+            return nullptr;
+        }
+        fs::path cache_path = dir / ScanCache::file_name;
+        if (cache_mode == CacheMode::Auto && !fs::exists(cache_path)) {
+            return nullptr;
+        }
+        auto opened = std::make_unique<ScanCache>(cache_path);
+        if (cache_mode != CacheMode::Rebuild) {
+            opened->load();
+        }
+        return opened;
+    }
+    
+    // A directory target's tree, ready to be printed
+    struct ScannedDirectory {
+        fs::path path;
+        TreeStore store;
+        std::unique_ptr<ScanCache> cache;
+        std::vector<fs::path> directories; // for --watch
+    };
+    
+    std::unique_ptr<ScannedDirectory> scan_directory(const fs::path& dir) const {
+        auto scanned = std::make_unique<ScannedDirectory>();
+        scanned->path = dir;
+        auto start = std::chrono::steady_clock::now();
+        scanned->cache = open_cache(dir);
+        ScanRoot scan{dir, scanned->cache.get(), watch_mode ? &scanned->directories : nullptr};
+        scan_tree(scanned->store, scan);
+        if (stats) {
+            RunStats::add(stats->scan_ns, elapsed_ns(start));
+        }
+        return scanned;
+    }
+    
+    void process_directory(ScannedDirectory& scanned) {
+        base_directory = scanned.path;
+        cache = std::move(scanned.cache);
+        std::string root_name = base_directory.filename().string();
+        
+        bool text = output_format == OutputFormat::Text;
+        if (text) {
+            out.write(root_name);
+            out.write("\n");
+        }
+        
+        std::vector<uint32_t> visible_files;
+        uint64_t tree_lines = text ? 1 : 0; // the root line
+        auto start = std::chrono::steady_clock::now();
+        print_tree(scanned.store, TreeStore::root, "", visible_files, tree_lines);
+        if (stats) {
+            RunStats::add(stats->tree_ns, elapsed_ns(start));
+        }
+        
+        // Records carry the listing, so with --format -d still emits them
+        if (!show_dir_only || !text) {
+            start = std::chrono::steady_clock::now();
+            print_file_content(scanned.store, visible_files, root_name, tree_lines);
+            if (stats) {
+                RunStats::add(stats->content_ns, elapsed_ns(start));
             }
-            
-            // Print warning about unknown extensions at the end
+        }
+        
+        if (cache) {
+            cache->save();
+            cache.reset();
+        }
+        
+        if (watch_mode) {
+            // Print warning about unknown extensions before the first event
             print_unknown_extensions_warning();
+            print_stats();
+            watch_tree(root_name, scanned.directories, scanned.store, visible_files);
+        }
+    }
+    
+    // A target as given on the command line, resolved before any output
+    struct Target {
+        std::string name;
+        fs::path path;
+        bool is_directory = false;
+        bool is_file = false;
+        std::string error; // printed in place of the target's output
+    };
+    
+    static Target resolve_target(const std::string& name) {
+        Target target;
+        target.name = name;
+        if (name.empty()) {
+            // Current directory
+            target.path = fs::current_path();
+            target.is_directory = true;
+            return target;
+        }
+        
+        // Make the target path absolute first to avoid issues with relative paths
+        try {
+            target.path = fs::absolute(fs::path(name));
+        } catch (const fs::filesystem_error& e) {
+            target.error = "Error: Cannot resolve path '" + name + "': " + e.what() + "\n";
+            return target;
+        }
+        
+        // One stat decides what the target is
+        struct stat target_info;
+        bool exists = ::stat(target.path.c_str(), &target_info) == 0;
+        target.is_directory = exists && S_ISDIR(target_info.st_mode);
+        target.is_file = exists && S_ISREG(target_info.st_mode);
+        if (!target.is_directory && !target.is_file) {
+            target.error = "Error: Target does not exist or is not accessible.\n";
+        }
+        return target;
+    }
+    
+    void process_file(const Target& target) {
+        // For files, get the parent directory safely
+        fs::path parent_path = target.path.parent_path();
+        if (parent_path.empty()) {
+            // If parent is empty, use current directory
+            base_directory = fs::current_path();
         } else {
-            fs::path target_path(target);
-            
-            // Make the target path absolute first to avoid issues with relative paths
-            fs::path absolute_target_path;
-            try {
-                absolute_target_path = fs::absolute(target_path);
-            } catch (const fs::filesystem_error& e) {
-                std::cout << "Error: Cannot resolve path '" << target << "': " << e.what() << std::endl;
-                return;
-            }
-            
-            if (fs::is_directory(absolute_target_path)) {
-                base_directory = absolute_target_path;
-                std::string root_name = base_directory.filename().string();
-                
-                std::cout << root_name << std::endl;
-                
-                std::vector<fs::path> visible_files;
-                print_tree(base_directory, "", visible_files);
-                
-                if (!show_dir_only) {
-                    print_file_content(visible_files, root_name, base_directory);
-                }
-                
-                // Print warning about unknown extensions at the end
-                print_unknown_extensions_warning();
-            } else if (fs::is_regular_file(absolute_target_path)) {
-                // For files, get the parent directory safely
-                fs::path parent_path = absolute_target_path.parent_path();
-                if (parent_path.empty()) {
-                    // If parent is empty, use current directory
-                    base_directory = fs::current_path();
-                } else {
-                    base_directory = parent_path;
-                }
-                
-                if (matches_patterns(absolute_target_path)) {
-                    print_single_file(absolute_target_path);
-                    // Print warning about unknown extensions at the end
-                    print_unknown_extensions_warning();
-                } else {
-                    std::cout << "No matching directories or files!" << std::endl;
+            base_directory = parent_path;
+        }
+        
+        if (watch_mode) {
+            std::cerr << "Warning: --watch only applies to directory targets" << std::endl;
+        }
+        
+        if (matches_patterns(target.path)) {
+            print_single_file(target.path);
+        } else {
+            print_message("No matching directories or files!\n");
+        }
+    }
+    
+    // Targets are printed one after another, each as if pptt had been run
+    // on it alone; filters, styles and the output stream are shared. With
+    // -j the next directory is scanned while the current one is written.
+    void process_targets(const std::vector<std::string>& names) {
+        run_start = std::chrono::steady_clock::now();
+        std::vector<Target> targets;
+        for (const auto& name : names) {
+            targets.push_back(resolve_target(name));
+        }
+        if (watch_mode && targets.size() > 1) {
+            std::cerr << "Warning: --watch only applies to a single target" << std::endl;
+            watch_mode = false;
+        }
+        
+        std::future<std::unique_ptr<ScannedDirectory>> prefetch;
+        size_t prefetched = targets.size();
+        for (size_t i = 0; i < targets.size(); ++i) {
+            const Target& target = targets[i];
+            target_start_bytes = out.bytes_written();
+            if (target.is_directory) {
+                std::unique_ptr<ScannedDirectory> scanned = prefetched == i ? prefetch.get() : scan_directory(target.path);
+                if (jobs > 1) {
+                    auto next = std::find_if(targets.begin() + i + 1, targets.end(),
+                                             [](const Target& t) { return t.is_directory; });
+                    if (next != targets.end()) {
+                        prefetched = next - targets.begin();
+                        prefetch = std::async(std::launch::async, [this, path = next->path] { return scan_directory(path); });
+                    }
                 }
+                process_directory(*scanned);
+            } else if (target.is_file) {
+                process_file(target);
             } else {
-                std::cout << "Error: Target does not exist or is not accessible." << std::endl;
+                print_message(target.error);
             }
+            
+            // Print warning about unknown extensions at the end of each
+            // target, as a separate run would
+            print_unknown_extensions_warning();
+            unknown_extensions.clear();
+            out.flush();
         }
+        
+        print_stats();
     }
 
     static void print_usage(const char* program_name) {
-        std::cout << "Usage: " << program_name << " [-d] [-n] [-e pattern] [-v pattern] [filename|directory]" << std::endl;
+        std::cout << "Usage: " << program_name << " [-d] [-n] [-g] [-j N] [-e pattern] [-v pattern] [-c pattern] [-C pattern] [filename|directory...]" << std::endl;
         std::cout << "  -d : only show the directory structure" << std::endl;
         std::cout << "  -n : show line numbers in file content" << std::endl;
+        std::cout << "  -g, --gitignore : skip what .gitignore and .ignore files in the scanned tree ignore" << std::endl;
+        std::cout << "                    (.git/info/exclude, core.excludesFile and ignore files above the" << std::endl;
+        std::cout << "                    scanned directory are not read)" << std::endl;
+        std::cout << "  -j N : scan directories and read files with N threads (0 = one per CPU, default 1)" << std::endl;
+        std::cout << "  --max-inflight SIZE : with -j, cap file output buffered ahead of stdout (default 64M)" << std::endl;
+        std::cout << "  --cache : keep a scan index in <directory>/.pptt-cache (used automatically once it exists)" << std::endl;
+        std::cout << "  --no-cache : ignore an existing .pptt-cache" << std::endl;
+        std::cout << "  --rebuild-cache : rescan everything and rewrite .pptt-cache" << std::endl;
+        std::cout << "  --max-bytes SIZE : stop once the output reaches SIZE bytes; the file that doesn't fit is cut" << std::endl;
+        std::cout << "                     at a line boundary and marked as truncated (the tree is always shown)" << std::endl;
+        std::cout << "  --max-lines N : the same limit counted in output lines" << std::endl;
+        std::cout << "  --prioritize small|recent : emit smallest or most recently modified files first" << std::endl;
+        std::cout << "  --format text|jsonl|binary : output layout. jsonl prints one JSON object per file with path, size," << std::endl;
+        std::cout << "                     lines, language and content; binary prints length-prefixed records" << std::endl;
+        std::cout << "                     (\"PPTT\", kind, path, language, size, lines, content; little-endian)" << std::endl;
+        std::cout << "                     instead of the tree. With -d, records have no content" << std::endl;
+        std::cout << "  --dedup : print each distinct file body once; later copies refer to the first path" << std::endl;
+        std::cout << "            (\"duplicate_of\" in jsonl, kind D with the path as content in binary)" << std::endl;
+        std::cout << "  --compress zstd[:LEVEL] : zstd-compress stdout (default level 3). Frames end on file" << std::endl;
+        std::cout << "                     boundaries, about every 1M of input" << std::endl;
+        std::cout << "  --compress-threads N : compress on N extra threads" << std::endl;
+        std::cout << "  --styles FILE : add or override comment styles, one '.ext SINGLE [START END]' per line" << std::endl;
+        std::cout << "                  ('-' for a marker the language lacks)" << std::endl;
+        std::cout << "  --stats : print counters and per-phase times to stderr when done" << std::endl;
+        std::cout << "  --watch : after the dump, keep running and print '@@ added|modified|removed: path' records" << std::endl;
+        std::cout << "            (with the new content) whenever a visible file changes" << std::endl;
         std::cout << "  -e pattern : only include files/directories matching pattern (regex)" << std::endl;
         std::cout << "  -v pattern : exclude files/directories matching pattern (regex)" << std::endl;
+        std::cout << "  -c pattern : only show the content of files whose content matches pattern" << std::endl;
+        std::cout << "  -C pattern : don't show the content of files whose content matches pattern" << std::endl;
+        std::cout << "               (regexes match line by line; the tree still lists every file -e/-v accept)" << std::endl;
         std::cout << "  Multiple -e and -v options can be used and are applied in order" << std::endl;
         std::cout << "  Patterns match against the full relative path from the base directory" << std::endl;
         std::cout << "  filename or directory : show output from given directory, or if a file, only the file content" << std::endl;
+        std::cout << "  Several targets are printed one after another, as separate runs would print them" << std::endl;
+        std::cout << "  --targets-from FILE : also read targets from FILE, one per line ('-' = stdin)" << std::endl;
         std::cout << "  If no arguments are provided, it will show both structure and content for the current directory" << std::endl;
         std::cout << std::endl;
         std::cout << "Examples:" << std::endl;
@@ -516,12 +3911,100 @@ public:
     }
 };
 
+// Parse a byte count with an optional K/M/G suffix (powers of 1024)
+static bool parse_size(const char* text, size_t& value) {
+    char* end = nullptr;
+    unsigned long long number = std::strtoull(text, &end, 10);
+    if (end == text || *text == '-') {
+        return false;
+    }
+    switch (std::toupper(static_cast<unsigned char>(*end))) {
+        case 'G': number <<= 10; [[fallthrough]];
+        case 'M': number <<= 10; [[fallthrough]];
+        case 'K': number <<= 10; ++end; break;
+        default: break;
+    }
+    if (*end != '\0') {
+        return false;
+    }
+    value = static_cast<size_t>(number);
+    return true;
+}
+
+enum LongOption {
+    OPT_MAX_INFLIGHT = 256,
+    OPT_CACHE,
+    OPT_NO_CACHE,
+    OPT_REBUILD_CACHE,
+    OPT_WATCH,
+    OPT_MAX_BYTES,
+    OPT_MAX_LINES,
+    OPT_PRIORITIZE,
+    OPT_FORMAT,
+    OPT_COMPRESS,
+    OPT_COMPRESS_THREADS,
+    OPT_DEDUP,
+    OPT_TARGETS_FROM,
+    OPT_STATS,
+    OPT_STYLES
+};
+
+// --targets-from: one target per line, blank lines skipped
+static bool read_target_list(const char* list_name, std::vector<std::string>& targets) {
+    std::ifstream file;
+    bool from_stdin = std::strcmp(list_name, "-") == 0;
+    if (!from_stdin) {
+        file.open(list_name);
+        if (!file) {
+            return false;
+        }
+    }
+    std::istream& in = from_stdin ? std::cin : file;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (!line.empty()) {
+            targets.push_back(line);
+        }
+    }
+    return true;
+}
+
 int main(int argc, char* argv[]) {
     TreePrinter printer;
-    std::string target;
+    std::vector<std::string> targets;
+    bool have_target_list = false;
+    
+    static const struct option long_options[] = {
+        {"gitignore", no_argument, nullptr, 'g'},
+        {"max-inflight", required_argument, nullptr, OPT_MAX_INFLIGHT},
+        {"cache", no_argument, nullptr, OPT_CACHE},
+        {"no-cache", no_argument, nullptr, OPT_NO_CACHE},
+        {"rebuild-cache", no_argument, nullptr, OPT_REBUILD_CACHE},
+        {"watch", no_argument, nullptr, OPT_WATCH},
+        {"max-bytes", required_argument, nullptr, OPT_MAX_BYTES},
+        {"max-lines", required_argument, nullptr, OPT_MAX_LINES},
+        {"prioritize", required_argument, nullptr, OPT_PRIORITIZE},
+        {"format", required_argument, nullptr, OPT_FORMAT},
+        {"compress", required_argument, nullptr, OPT_COMPRESS},
+        {"compress-threads", required_argument, nullptr, OPT_COMPRESS_THREADS},
+        {"dedup", no_argument, nullptr, OPT_DEDUP},
+        {"targets-from", required_argument, nullptr, OPT_TARGETS_FROM},
+        {"stats", no_argument, nullptr, OPT_STATS},
+        {"styles", required_argument, nullptr, OPT_STYLES},
+        {nullptr, 0, nullptr, 0}
+    };
+    
+    uint64_t max_bytes = 0;
+    uint64_t max_lines = 0;
+    bool compress = false;
+    int compress_level = 3;
+    int compress_threads = 0;
     
     int opt;
-    while ((opt = getopt(argc, argv, "dne:v:")) != -1) {
+    while ((opt = getopt_long(argc, argv, "dngj:e:v:c:C:", long_options, nullptr)) != -1) {
         switch (opt) {
             case 'd':
                 printer.set_show_dir_only(true);
@@ -529,11 +4012,147 @@ int main(int argc, char* argv[]) {
             case 'n':
                 printer.set_show_line_numbers(true);
                 break;
+            case 'g':
+                printer.set_use_ignore_files(true);
+                break;
+            case 'j': {
+                char* end = nullptr;
+                long value = std::strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || value < 0) {
+                    std::cerr << "Invalid job count '" << optarg << "'" << std::endl;
+                    return 1;
+                }
+                if (value == 0) {
+                    value = std::max(1u, std::thread::hardware_concurrency());
+                }
+                printer.set_jobs(static_cast<unsigned>(value));
+                break;
+            }
             case 'e':
-                printer.add_pattern_filter(optarg, true);  // include pattern
+                if (!printer.add_pattern_filter(optarg, true)) {  // include pattern
+                    return 1;
+                }
                 break;
             case 'v':
-                printer.add_pattern_filter(optarg, false); // exclude pattern
+                if (!printer.add_pattern_filter(optarg, false)) { // exclude pattern
+                    return 1;
+                }
+                break;
+            case 'c':
+                if (!printer.add_content_filter(optarg, true)) {
+                    return 1;
+                }
+                break;
+            case 'C':
+                if (!printer.add_content_filter(optarg, false)) {
+                    return 1;
+                }
+                break;
+            case OPT_MAX_INFLIGHT: {
+                size_t value = 0;
+                if (!parse_size(optarg, value)) {
+                    std::cerr << "Invalid size '" << optarg << "'" << std::endl;
+                    return 1;
+                }
+                printer.set_max_inflight_bytes(value);
+                break;
+            }
+            case OPT_CACHE:
+                printer.set_cache_mode(CacheMode::On);
+                break;
+            case OPT_NO_CACHE:
+                printer.set_cache_mode(CacheMode::Off);
+                break;
+            case OPT_REBUILD_CACHE:
+                printer.set_cache_mode(CacheMode::Rebuild);
+                break;
+            case OPT_WATCH:
+                printer.set_watch_mode(true);
+                break;
+            case OPT_MAX_BYTES:
+            case OPT_MAX_LINES: {
+                size_t value = 0;
+                if (!parse_size(optarg, value) || value == 0) {
+                    std::cerr << "Invalid limit '" << optarg << "'" << std::endl;
+                    return 1;
+                }
+                if (opt == OPT_MAX_BYTES) {
+                    max_bytes = value;
+                } else {
+                    max_lines = value;
+                }
+                break;
+            }
+            case OPT_COMPRESS: {
+                std::string value = optarg;
+                char* end = nullptr;
+                if (value.compare(0, 4, "zstd") != 0 || (value.size() > 4 && value[4] != ':')) {
+                    std::cerr << "Invalid compression '" << optarg << "' (expected zstd[:level])" << std::endl;
+                    return 1;
+                }
+                if (value.size() > 4) {
+                    long level = std::strtol(value.c_str() + 5, &end, 10);
+                    if (value.size() == 5 || *end != '\0') {
+                        std::cerr << "Invalid compression level in '" << optarg << "'" << std::endl;
+                        return 1;
+                    }
+                    compress_level = static_cast<int>(level);
+                }
+                compress = true;
+                break;
+            }
+            case OPT_COMPRESS_THREADS: {
+                char* end = nullptr;
+                long value = std::strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || value < 0) {
+                    std::cerr << "Invalid thread count '" << optarg << "'" << std::endl;
+                    return 1;
+                }
+                compress_threads = static_cast<int>(value);
+                break;
+            }
+            case OPT_TARGETS_FROM:
+                if (!read_target_list(optarg, targets)) {
+                    std::cerr << "Cannot read target list '" << optarg << "'" << std::endl;
+                    return 1;
+                }
+                have_target_list = true;
+                break;
+            case OPT_STYLES: {
+                std::string error;
+                if (!printer.load_comment_styles(optarg, error)) {
+                    std::cerr << "Invalid styles file: " << error << std::endl;
+                    return 1;
+                }
+                break;
+            }
+            case OPT_STATS:
+                printer.set_stats(true);
+                break;
+            case OPT_DEDUP:
+                printer.set_dedup(true);
+                break;
+            case OPT_FORMAT:
+                if (std::string(optarg) == "text") {
+                    printer.set_output_format(OutputFormat::Text);
+                } else if (std::string(optarg) == "jsonl") {
+                    printer.set_output_format(OutputFormat::Jsonl);
+                } else if (std::string(optarg) == "binary") {
+                    printer.set_output_format(OutputFormat::Binary);
+                } else {
+                    std::cerr << "Invalid format '" << optarg << "' (expected text, jsonl or binary)" << std::endl;
+                    return 1;
+                }
+                break;
+            case OPT_PRIORITIZE:
+                if (std::string(optarg) == "small") {
+                    printer.set_priority(Priority::Smallest);
+                } else if (std::string(optarg) == "recent") {
+                    printer.set_priority(Priority::Recent);
+                } else {
+                    std::cerr << "Invalid priority '" << optarg << "' (expected small or recent)" << std::endl;
+                    return 1;
+                }
                 break;
             default:
                 TreePrinter::print_usage(argv[0]);
@@ -541,12 +4160,23 @@ int main(int argc, char* argv[]) {
         }
     }
     
-    // Get remaining argument (target)
-    if (optind < argc) {
-        target = argv[optind];
+    printer.set_output_budget(max_bytes, max_lines);
+    
+    std::string compress_error;
+    if (compress && !printer.enable_compression(compress_level, compress_threads, compress_error)) {
+        std::cerr << "Cannot compress output: " << compress_error << std::endl;
+        return 1;
+    }
+    
+    // Remaining arguments are targets; none means the current directory
+    for (int i = optind; i < argc; ++i) {
+        targets.push_back(argv[i]);
+    }
+    if (targets.empty() && !have_target_list) {
+        targets.push_back("");
     }
     
-    printer.process_target(target);
+    printer.process_targets(targets);
     
     return 0;
 }
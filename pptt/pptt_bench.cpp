@@ -0,0 +1,460 @@
+// pptt_bench: generate a synthetic tree and time pptt on it
+#include <iostream>
+#include <string>
+#include <vector>
+#include <filesystem>
+#include <fstream>
+#include <algorithm>
+#include <map>
+#include <sstream>
+#include <random>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+#ifndef PPTT_PATH
+#define PPTT_PATH "pptt"
+#endif
+
+extern char** environ;
+
+namespace fs = std::filesystem;
+
+// Shape of the generated tree
+struct TreeSpec {
+    int depth = 3;             // directory levels below the root
+    int fanout = 4;            // subdirectories per directory
+    int files_per_dir = 8;
+    uint64_t min_size = 256;   // file sizes are log-uniform in [min_size, max_size]
+    uint64_t max_size = 64 * 1024;
+    double binary_ratio = 0.05;
+    uint64_t seed = 1;
+};
+
+// What was generated
+struct TreeStats {
+    uint64_t directories = 0;
+    uint64_t files = 0;
+    uint64_t binary_files = 0;
+    uint64_t bytes = 0;
+    uint64_t text_bytes = 0;
+};
+
+class TreeGenerator {
+public:
+    explicit TreeGenerator(const TreeSpec& spec) : spec(spec), random(spec.seed) {}
+    
+    TreeStats generate(const fs::path& root) {
+        fs::create_directories(root);
+        stats = TreeStats();
+        generate_directory(root, 0);
+        return stats;
+    }
+    
+private:
+    static constexpr const char* text_extensions[] = {".cpp", ".h", ".py", ".md", ".txt", ".json", ".sh"};
+    static constexpr const char* words[] = {
+        "int", "return", "value", "for", "while", "const", "auto", "path", "file", "the",
+        "data", "if", "else", "size", "index", "name", "result", "error", "count", "node"
+    };
+    
+    const TreeSpec& spec;
+    std::mt19937_64 random;
+    TreeStats stats;
+    
+    void generate_directory(const fs::path& dir, int level) {
+        stats.directories++;
+        for (int i = 0; i < spec.files_per_dir; ++i) {
+            generate_file(dir, i);
+        }
+        if (level == spec.depth) {
+            return;
+        }
+        for (int i = 0; i < spec.fanout; ++i) {
+            fs::path subdirectory = dir / ("dir" + std::to_string(i));
+            fs::create_directory(subdirectory);
+            generate_directory(subdirectory, level + 1);
+        }
+    }
+    
+    uint64_t pick_size() {
+        double low = std::log(static_cast<double>(std::max<uint64_t>(spec.min_size, 1)));
+        double high = std::log(static_cast<double>(std::max(spec.max_size, spec.min_size)));
+        std::uniform_real_distribution<double> exponent(low, high);
+        return static_cast<uint64_t>(std::exp(exponent(random)));
+    }
+    
+    void generate_file(const fs::path& dir, int number) {
+        bool binary = std::uniform_real_distribution<double>(0, 1)(random) < spec.binary_ratio;
+        uint64_t size = pick_size();
+        std::string content;
+        content.reserve(size);
+        std::string name = "file" + std::to_string(number);
+        if (binary) {
+            name += ".bin";
+            while (content.size() < size) {
+                content += static_cast<char>(random() & 0xff);
+            }
+            content[0] = '\0'; // always caught by the sniff
+            stats.binary_files++;
+        } else {
+            name += text_extensions[random() % std::size(text_extensions)];
+            while (content.size() < size) {
+                int line_words = 1 + random() % 10;
+                for (int i = 0; i < line_words; ++i) {
+                    content += words[random() % std::size(words)];
+                    content += i + 1 < line_words ? ' ' : '\n';
+                }
+            }
+            content.resize(size);
+            content.back() = '\n';
+            stats.text_bytes += size;
+        }
+        
+        std::ofstream file(dir / name, std::ios::binary);
+        file.write(content.data(), static_cast<std::streamsize>(content.size()));
+        stats.files++;
+        stats.bytes += size;
+    }
+};
+
+// One way of running pptt
+struct Mode {
+    const char* name;
+    std::vector<std::string> args;
+    bool reads_text; // text content is read and emitted, so MB/s is meaningful
+};
+
+// Median of each --stats timer over the profiling runs, in seconds
+using PhaseTimes = std::map<std::string, double>;
+
+struct ModeResult {
+    const Mode* mode;
+    double median_seconds;
+    double best_seconds;
+    uint64_t output_bytes;
+    int exit_status;
+    PhaseTimes phases;
+};
+
+class Benchmark {
+public:
+    Benchmark(std::string pptt, int runs) : pptt(std::move(pptt)), runs(runs) {}
+    
+    // Median and best of the timed runs, after one untimed run that warms
+    // the page cache
+    ModeResult run_mode(const Mode& mode, const fs::path& tree) const {
+        ModeResult result{&mode, 0, 0, 0, 0, {}};
+        std::vector<double> times;
+        run_once(mode, tree, result.output_bytes, result.exit_status);
+        for (int i = 0; i < runs; ++i) {
+            auto start = std::chrono::steady_clock::now();
+            run_once(mode, tree, result.output_bytes, result.exit_status);
+            times.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        }
+        std::sort(times.begin(), times.end());
+        result.median_seconds = times[times.size() / 2];
+        result.best_seconds = times.front();
+        return result;
+    }
+    
+    // Phase costs of a mode as pptt measures them itself: separate runs
+    // with --stats added, so the timed runs above don't pay for it, and the
+    // timers it prints ("scan:   1.234 ms") are collected per run. Timers
+    // indented under another are part of it.
+    PhaseTimes profile_phases(const Mode& mode, const fs::path& tree, const fs::path& stats_path) const {
+        Mode profiled = mode;
+        profiled.args.insert(profiled.args.begin(), "--stats");
+        std::map<std::string, std::vector<double>> samples;
+        uint64_t output_bytes;
+        int exit_status;
+        for (int i = 0; i < runs; ++i) {
+            run_once(profiled, tree, output_bytes, exit_status, &stats_path);
+            std::ifstream stats(stats_path);
+            std::string line;
+            while (std::getline(stats, line)) {
+                size_t colon = line.find(':');
+                size_t unit = line.rfind(" ms");
+                if (colon == std::string::npos || unit == std::string::npos || unit + 3 != line.size()) {
+                    continue;
+                }
+                std::string label = line.substr(0, colon);
+                label.erase(0, label.find_first_not_of(' '));
+                samples[label].push_back(std::strtod(line.c_str() + colon + 1, nullptr) / 1e3);
+            }
+        }
+        
+        std::error_code error;
+        fs::remove(stats_path, error);
+        
+        PhaseTimes phases;
+        for (auto& [label, times] : samples) {
+            std::sort(times.begin(), times.end());
+            phases[label] = times[times.size() / 2];
+        }
+        return phases;
+    }
+    
+private:
+    std::string pptt;
+    int runs;
+    
+    // Run pptt with stdout on a pipe that is drained and counted, so the
+    // time includes getting the output out. stderr goes to stderr_path if
+    // given, otherwise it is discarded.
+    void run_once(const Mode& mode, const fs::path& tree, uint64_t& output_bytes, int& exit_status,
+                  const fs::path* stderr_path = nullptr) const {
+        std::vector<std::string> args = {pptt};
+        args.insert(args.end(), mode.args.begin(), mode.args.end());
+        args.push_back(tree.string());
+        std::vector<char*> argv;
+        for (auto& arg : args) {
+            argv.push_back(arg.data());
+        }
+        argv.push_back(nullptr);
+        
+        int pipe_fds[2];
+        if (::pipe2(pipe_fds, O_CLOEXEC) != 0) {
+            throw std::runtime_error(std::string("pipe: ") + std::strerror(errno));
+        }
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, pipe_fds[1], STDOUT_FILENO);
+        std::string error_file = stderr_path ? stderr_path->string() : "/dev/null";
+        posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, error_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        pid_t pid;
+        int spawn_error = ::posix_spawn(&pid, pptt.c_str(), &actions, nullptr, argv.data(), environ);
+        posix_spawn_file_actions_destroy(&actions);
+        ::close(pipe_fds[1]);
+        if (spawn_error != 0) {
+            ::close(pipe_fds[0]);
+            throw std::runtime_error("cannot run " + pptt + ": " + std::strerror(spawn_error));
+        }
+        
+        std::vector<char> buffer(1 << 20);
+        output_bytes = 0;
+        while (true) {
+            ssize_t count = ::read(pipe_fds[0], buffer.data(), buffer.size());
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count <= 0) {
+                break;
+            }
+            output_bytes += static_cast<uint64_t>(count);
+        }
+        ::close(pipe_fds[0]);
+        
+        int status = 0;
+        while (::waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+        }
+        exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    }
+};
+
+static void write_json(std::ostream& out, const TreeSpec& spec, const TreeStats& stats, int runs,
+                       const std::vector<ModeResult>& results) {
+                       
+    out << "{\n";
+    out << "  \"tree\": {\"depth\": " << spec.depth << ", \"fanout\": " << spec.fanout
+        << ", \"files_per_dir\": " << spec.files_per_dir << ", \"min_size\": " << spec.min_size
+        << ", \"max_size\": " << spec.max_size << ", \"binary_ratio\": " << spec.binary_ratio
+        << ", \"seed\": " << spec.seed << ",\n";
+    out << "           \"directories\": " << stats.directories << ", \"files\": " << stats.files
+        << ", \"binary_files\": " << stats.binary_files << ", \"bytes\": " << stats.bytes << "},\n";
+    out << "  \"runs\": " << runs << ",\n";
+    out << "  \"modes\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const ModeResult& result = results[i];
+        std::string args;
+        for (const auto& arg : result.mode->args) {
+            args += (args.empty() ? "" : " ") + arg;
+        }
+        double seconds = std::max(result.median_seconds, 1e-9);
+        out << "    {\"name\": \"" << result.mode->name << "\", \"args\": \"";
+        for (char c : args) {
+            if (c == '"' || c == '\\') {
+                out << '\\';
+            }
+            out << c;
+        }
+        out << "\", \"seconds\": " << result.median_seconds << ", \"best_seconds\": " << result.best_seconds
+            << ", \"files_per_second\": " << stats.files / seconds;
+        if (result.mode->reads_text) {
+            out << ", \"input_mb_per_second\": " << stats.text_bytes / seconds / 1e6;
+        }
+        out << ", \"output_bytes\": " << result.output_bytes
+            << ", \"output_mb_per_second\": " << result.output_bytes / seconds / 1e6
+            << ", \"exit_status\": " << result.exit_status;
+            
+        // From pptt's own timers. filtering_cpu is part of scan;
+        // binary_sniff_cpu and stdout_writes are part of content_emission.
+        // The cpu timers add up all threads.
+        auto phase = [&result](const char* label) {
+            auto found = result.phases.find(label);
+            return found == result.phases.end() ? 0.0 : found->second;
+        };
+        out << ",\n     \"phases\": {\"scan\": " << phase("scan")
+            << ", \"filtering_cpu\": " << phase("filtering (cpu)")
+            << ", \"tree\": " << phase("tree")
+            << ", \"content_emission\": " << phase("content")
+            << ", \"binary_sniff_cpu\": " << phase("binary sniff (cpu)")
+            << ", \"stdout_writes\": " << phase("stdout writes")
+            << ", \"total\": " << phase("total") << "}}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n";
+    out << "}\n";
+}
+
+static void print_usage(const char* program_name) {
+    std::cout << "Usage: " << program_name << " [options]" << std::endl;
+    std::cout << "  --depth N : directory levels below the root (default 3)" << std::endl;
+    std::cout << "  --fanout N : subdirectories per directory (default 4)" << std::endl;
+    std::cout << "  --files N : files per directory (default 8)" << std::endl;
+    std::cout << "  --min-size SIZE, --max-size SIZE : log-uniform file size range in bytes (default 256..65536)" << std::endl;
+    std::cout << "  --binary-ratio R : fraction of binary files (default 0.05)" << std::endl;
+    std::cout << "  --seed N : random seed, the same seed gives the same tree (default 1)" << std::endl;
+    std::cout << "  --runs N : timed runs per mode; the median is reported (default 3)" << std::endl;
+    std::cout << "  --dir PATH : generate the tree here and keep it (default: a temporary directory)" << std::endl;
+    std::cout << "  --pptt PATH : pptt binary to time (default: the one built alongside)" << std::endl;
+    std::cout << "  -o FILE : write the JSON results to FILE instead of stdout" << std::endl;
+}
+
+enum LongOption {
+    OPT_DEPTH = 256,
+    OPT_FANOUT,
+    OPT_FILES,
+    OPT_MIN_SIZE,
+    OPT_MAX_SIZE,
+    OPT_BINARY_RATIO,
+    OPT_SEED,
+    OPT_RUNS,
+    OPT_DIR,
+    OPT_PPTT
+};
+
+static bool parse_number(const char* text, uint64_t& value) {
+    char* end = nullptr;
+    value = std::strtoull(text, &end, 10);
+    return *text != '\0' && *text != '-' && *end == '\0';
+}
+
+int main(int argc, char* argv[]) {
+    TreeSpec spec;
+    int runs = 3;
+    std::string pptt = PPTT_PATH;
+    std::string output_path;
+    fs::path tree_dir;
+    
+    static const struct option long_options[] = {
+        {"depth", required_argument, nullptr, OPT_DEPTH},
+        {"fanout", required_argument, nullptr, OPT_FANOUT},
+        {"files", required_argument, nullptr, OPT_FILES},
+        {"min-size", required_argument, nullptr, OPT_MIN_SIZE},
+        {"max-size", required_argument, nullptr, OPT_MAX_SIZE},
+        {"binary-ratio", required_argument, nullptr, OPT_BINARY_RATIO},
+        {"seed", required_argument, nullptr, OPT_SEED},
+        {"runs", required_argument, nullptr, OPT_RUNS},
+        {"dir", required_argument, nullptr, OPT_DIR},
+        {"pptt", required_argument, nullptr, OPT_PPTT},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}
+    };
+    
+    int opt;
+    while ((opt = getopt_long(argc, argv, "o:h", long_options, nullptr)) != -1) {
+        uint64_t value = 0;
+        bool numeric = opt >= OPT_DEPTH && opt <= OPT_RUNS && opt != OPT_BINARY_RATIO;
+        if (numeric && !parse_number(optarg, value)) {
+            std::cerr << "Invalid number '" << optarg << "'" << std::endl;
+            return 1;
+        }
+        switch (opt) {
+            case OPT_DEPTH: spec.depth = static_cast<int>(value); break;
+            case OPT_FANOUT: spec.fanout = static_cast<int>(value); break;
+            case OPT_FILES: spec.files_per_dir = static_cast<int>(value); break;
+            case OPT_MIN_SIZE: spec.min_size = std::max<uint64_t>(value, 1); break;
+            case OPT_MAX_SIZE: spec.max_size = std::max<uint64_t>(value, 1); break;
+            case OPT_SEED: spec.seed = value; break;
+            case OPT_RUNS: runs = std::max(1, static_cast<int>(value)); break;
+            case OPT_BINARY_RATIO: {
+                char* end = nullptr;
+                spec.binary_ratio = std::strtod(optarg, &end);
+                if (*end != '\0' || spec.binary_ratio < 0 || spec.binary_ratio > 1) {
+                    std::cerr << "Invalid binary ratio '" << optarg << "' (expected 0..1)" << std::endl;
+                    return 1;
+                }
+                break;
+            }
+            case OPT_DIR: tree_dir = optarg; break;
+            case OPT_PPTT: pptt = optarg; break;
+            case 'o': output_path = optarg; break;
+            case 'h':
+                print_usage(argv[0]);
+                return 0;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+    
+    bool temporary = tree_dir.empty();
+    if (temporary) {
+        std::string pattern = (fs::temp_directory_path() / "pptt_bench.XXXXXX").string();
+        if (!::mkdtemp(pattern.data())) {
+            std::cerr << "Cannot create a temporary directory: " << std::strerror(errno) << std::endl;
+            return 1;
+        }
+        tree_dir = pattern;
+    }
+    
+    const std::vector<Mode> modes = {
+        {"traversal", {"-d"}, false},
+        {"filter", {"-d", "-e", "\\.(cpp|h|py)$", "-v", "dir1/"}, false},
+        {"binary_sniff", {"-e", "\\.bin$"}, false},
+        {"content", {}, true},
+        {"content_numbered", {"-n"}, true},
+        {"content_parallel", {"-j", "0"}, true},
+    };
+    
+    int status = 0;
+    try {
+        TreeGenerator generator(spec);
+        TreeStats stats = generator.generate(tree_dir / "tree");
+        
+        Benchmark benchmark(pptt, runs);
+        std::vector<ModeResult> results;
+        for (const auto& mode : modes) {
+            results.push_back(benchmark.run_mode(mode, tree_dir / "tree"));
+            results.back().phases = benchmark.profile_phases(mode, tree_dir / "tree", tree_dir / "stats.txt");
+        }
+        
+        if (output_path.empty()) {
+            write_json(std::cout, spec, stats, runs, results);
+        } else {
+            std::ofstream out(output_path);
+            write_json(out, spec, stats, runs, results);
+            if (!out) {
+                std::cerr << "Cannot write " << output_path << std::endl;
+                status = 1;
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        status = 1;
+    }
+    
+    if (temporary) {
+        std::error_code error;
+        fs::remove_all(tree_dir, error);
+    }
+    return status;
+}